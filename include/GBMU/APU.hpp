@@ -118,7 +118,7 @@ public:
 	u8   read_byte(u16 address);
 	void write_byte(u16 address, u8 value);
 
-	u8   wave_pattern[0x10];
+	u8  *wave_pattern; // In the GameBoy's memory arena
 };
 
 } // namespace GBMU
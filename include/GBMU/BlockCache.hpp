@@ -0,0 +1,102 @@
+#pragma once
+
+#ifdef GBMU_DYNAREC
+# include <memory>
+#endif
+#include <string>
+#include <types.h>
+#include <unordered_map>
+#include <vector>
+
+#define BLOCK_MAX_INSTRUCTIONS 64
+#define DYNAREC_MIN_RUNS       16 // Lookups of a block before it is translated
+
+namespace GBMU {
+
+class GameBoy;
+class CPU;
+class RomImage;
+class Dynarec;
+
+// Predecoded straight-line runs of cartridge ROM code, keyed by (ROM bank, address)
+class BlockCache {
+public:
+	struct Instruction {
+		void (*handler)(CPU &); // Opcode handler, resolved once when decoding
+		u8 bytes[6];            // Opcode followed by its operands, several of them once fused
+		u8 length;
+		u8 cycles;              // Cost when no branch is taken
+	};
+
+	struct Block {
+		u16                      bank;
+		u16                      start;
+		u16                      end;    // Address right after the last instruction
+		u16                      cycles; // Cost of the whole block when no branch is taken
+		std::vector<Instruction> instructions;
+
+		// Set when the block is a loop that only polls an MMIO register (see CPU::skip_idle_loop)
+		u16                      poll_address = 0;
+		u16                      loop_cycles  = 0; // Cost of one iteration
+
+		// Whole block compiled ahead of time (see src/recompiler.cpp) or by the Dynarec, or nullptr
+		void (*native)(CPU &)                 = nullptr;
+		u16                      runs         = 0; // Lookups, only hot blocks are translated
+	};
+
+	// Entry of the block table exported by a recompiled shared object
+	struct Native {
+		u16 bank;
+		u16 start;
+		void (*run)(CPU &);
+	};
+
+private:
+	GameBoy                                    *gb; // nullptr when decoding offline
+	const u8                                   *rom_data;
+	size_t                                      rom_size;
+
+	std::vector<std::unordered_map<u16, Block>> banks;
+
+#ifdef GBMU_RECOMPILER
+	void                                       *native_library = nullptr;
+	std::unordered_map<u32, void (*)(CPU &)>    natives; // Keyed by bank << 16 | start
+#endif
+
+#ifdef GBMU_DYNAREC
+	std::unique_ptr<Dynarec>                    dynarec; // nullptr when disabled or offline
+#endif
+
+	u8                                          read_rom(u16 bank, u32 address);
+	void                                        decode(Block &block);
+	void                                        detect_idle_loop(Block &block);
+#ifdef GBMU_FUSION
+	void                                        fuse(Block &block);
+#endif
+
+public:
+	BlockCache(GameBoy &);
+	// Decodes a ROM without running it, blocks can then only be looked up by bank
+	BlockCache(const RomImage &);
+	virtual ~BlockCache();
+
+	// Bank currently mapped at address, or -1 when code there must go through the interpreter
+	int          bank(u16 address);
+
+	const Block *lookup(u16 address);
+	const Block *lookup(u16 bank, u16 address);
+
+	size_t       bankCount() const { return banks.size(); }
+
+#ifdef GBMU_RECOMPILER
+	// Loads blocks generated by the recompiler for the running ROM
+	void         load_native(const std::string &path);
+#endif
+
+#ifdef GBMU_DYNAREC
+	// Drops every decoded block, since they may have been translated
+	void         setDynarecEnabled(bool enabled);
+#endif
+};
+
+} // namespace GBMU
@@ -1,7 +1,14 @@
 #pragma once
 
+#include <GBMU/BlockCache.hpp>
+#include <GBMU/HotState.hpp>
+#include <array>
+#include <cstddef>
 #include <cstdint>
 #include <types.h>
+#ifdef GBMU_PROFILE_NGRAMS
+# include <unordered_map>
+#endif
 
 #define TICKS_PER_CYCLES 4
 
@@ -10,216 +17,308 @@ namespace GBMU {
 class GameBoy;
 
 class CPU {
+	friend class BlockCache;
+	friend class Dynarec;
+
 private:
-	GameBoy &gb;
-	int      ticks                  = 0;
+	GameBoy  &gb;
+	HotState &hot; // Registers, interrupts and cycle count, shared with the PPU and Timer
+
+	// Predecoded ROM code, so that opcode fetches skip the memory map
+	BlockCache               cache;
+	const BlockCache::Block *block          = nullptr; // Block being executed
+	size_t                   block_index    = 0;       // Next instruction in that block
+	u16                      block_pc       = 0;       // Address of that instruction
+	const u8                *prefetch       = nullptr; // Bytes served to imm8() instead of memory
+	u16                      instruction_pc = 0;       // Reported by watchpoints
+
+	const BlockCache::Instruction *predecoded();
+	int                            skip_idle_loop();
+
+	// Several instructions run in one step (native blocks) leave their cycles to the end of the
+	// step, unless something could observe the PPU and Timer before: see next_native() and
+	// catch_up()
+	int                            deferred_cycles = -1; // Given to neither yet, -1 outside
+	int                            native_budget   = 0;  // Cycles until their next event
+	bool                           caught_up       = false;
+
+	void                           run_native(const BlockCache::Block &block);
+
+	// Before the next instruction of a native block: whether the interpreter would run it in the
+	// same state, without an interrupt, an event or a catch up in between
+	inline bool                    next_native()
+	{
+		if (caught_up || hot.ticks >= native_budget || hot.halted || hot.enable_interrupt_delay ||
+		    (hot.ime && (hot.interrupt_flags & hot.interrupt_enable)))
+			return false;
 
-	u8       interrupt_flags        = 0;
-	u8       interrupt_enable       = 0;
-	u8       ime                    = 0;
-	bool     enable_interrupt_delay = false;
+		deferred_cycles = hot.ticks;
+		return true;
+	}
 
-	bool     halted                 = false;
+	// One handler per opcode, operands are decoded at compile time
+	using Handler = void (*)(CPU &);
 
-	enum Flag { ZERO = 1 << 7, NEGATIVE = 1 << 6, HALF_CARRY = 1 << 5, CARRY = 1 << 4 };
+	static const std::array<Handler, 0x100> OPCODES;
+	static const std::array<Handler, 0x100> CB_OPCODES;
 
-	struct Registers {
-#define REGISTER_PAIR(low, high, word)                                                             \
-	union {                                                                                        \
-		struct {                                                                                   \
-			u8 low;                                                                                \
-			u8 high;                                                                               \
-		};                                                                                         \
-		u16 word;                                                                                  \
-	}
+	template <u8 opcode> void execute();
+	template <u8 opcode> void execute_cb();
+
+#ifdef GBMU_RECOMPILER
+	template <u16 opcode> bool execute_native();
+#endif
+
+#ifdef GBMU_FUSION
+	// Frequent instruction sequences, run by the block cache as a single handler
+	struct Fusion {
+		u8      opcodes[4];
+		u8      count;
+		Handler handler;
+	};
+
+	static const std::array<Fusion, 10>           FUSIONS;
 
-		REGISTER_PAIR(f, a, af);
-		REGISTER_PAIR(c, b, bc);
-		REGISTER_PAIR(e, d, de);
-		REGISTER_PAIR(l, h, hl);
+	template <u8 first, u8... rest> void execute_fused();
+	template <u8... opcodes> static constexpr Fusion fuse();
+#endif
 
-#undef REGISTER_PAIR
+#ifdef GBMU_PROFILE_NGRAMS
+	// Executed opcode pairs and triples, dumped on destruction to tune FUSIONS
+	u32                          ngram_history = 0;
+	u64                          ngram_opcodes = 0; // Opcodes profiled so far
+	std::unordered_map<u32, u64> bigrams;
+	std::unordered_map<u32, u64> trigrams;
 
-		u16 sp;
-		u16 pc;
-	} registers;
+	void                         profile_ngram(u8 opcode);
+	void                         dump_ngrams();
+#endif
 
 	u8          read_byte(u16 address);
 	void        write_byte(u16 address, u8 value);
 
-	inline u8   imm8() { return read_byte(registers.pc++); }
-	inline u16  imm16() { return imm8() | (imm8() << 8); }
+#ifdef GBMU_LOCKSTEP
+	void lockstep(u16 address, u8 predecoded);
+#endif
 
-	inline void set_r16(u16 &r16, u16 address)
+	inline u8 imm8()
 	{
-		ticks += TICKS_PER_CYCLES;
-		r16    = address;
-	}
-
-	inline u8 read_r8(u8 code)
-	{
-		switch (code & 0b111) {
-		case 0b000:
-			return registers.b;
-		case 0b001:
-			return registers.c;
-		case 0b010:
-			return registers.d;
-		case 0b011:
-			return registers.e;
-		case 0b100:
-			return registers.h;
-		case 0b101:
-			return registers.l;
-		case 0b110:
-			return read_byte(registers.hl);
-		default:
-			return registers.a;
+		if (prefetch) {
+#ifdef GBMU_LOCKSTEP
+			lockstep(hot.registers.pc, *prefetch);
+#endif
+			hot.ticks += TICKS_PER_CYCLES;
+			hot.registers.pc++;
+			return *prefetch++;
 		}
+		return read_byte(hot.registers.pc++);
 	}
 
-	inline void write_r8(u8 code, u8 value)
-	{
-		switch (code & 0b111) {
-		case 0b000:
-			registers.b = value;
-			break;
-		case 0b001:
-			registers.c = value;
-			break;
-		case 0b010:
-			registers.d = value;
-			break;
-		case 0b011:
-			registers.e = value;
-			break;
-		case 0b100:
-			registers.h = value;
-			break;
-		case 0b101:
-			registers.l = value;
-			break;
-		case 0b110:
-			write_byte(registers.hl, value);
-			break;
-		default:
-			registers.a = value;
-			break;
-		}
+	inline u16 imm16()
+	{
+		u8 low = imm8();
+		return low | (imm8() << 8);
 	}
 
-	inline u16 &r16(u8 code)
+	inline void set_r16(u16 &r16, u16 address)
 	{
-		switch (code & 0b11) {
-		case 0b00:
-			return registers.bc;
-		case 0b01:
-			return registers.de;
-		case 0b10:
-			return registers.hl;
-		default:
-			return registers.sp;
-		}
+		hot.ticks += TICKS_PER_CYCLES;
+		r16        = address;
 	}
 
-	inline u8 read_r16mem(u8 code)
+	template <u8 code> inline u8 &r8()
 	{
-		switch (code & 0b11) {
-		case 0b00:
-			return read_byte(registers.bc);
-		case 0b01:
-			return read_byte(registers.de);
-		case 0b10:
-			return read_byte(registers.hl++);
-		default:
-			return read_byte(registers.hl--);
-		}
+		static_assert((code & 0b111) != 0b110, "[hl] is not a register");
+
+		if constexpr ((code & 0b111) == 0b000)
+			return hot.registers.b;
+		else if constexpr ((code & 0b111) == 0b001)
+			return hot.registers.c;
+		else if constexpr ((code & 0b111) == 0b010)
+			return hot.registers.d;
+		else if constexpr ((code & 0b111) == 0b011)
+			return hot.registers.e;
+		else if constexpr ((code & 0b111) == 0b100)
+			return hot.registers.h;
+		else if constexpr ((code & 0b111) == 0b101)
+			return hot.registers.l;
+		else
+			return hot.registers.a;
 	}
 
-	inline void write_r16mem(u8 code, u8 value)
-	{
-		switch (code & 0b11) {
-		case 0b00:
-			write_byte(registers.bc, value);
-			break;
-		case 0b01:
-			write_byte(registers.de, value);
-			break;
-		case 0b10:
-			write_byte(registers.hl++, value);
-			break;
-		default:
-			write_byte(registers.hl--, value);
-			break;
-		}
+	template <u8 code> inline u8 read_r8()
+	{
+		if constexpr ((code & 0b111) == 0b110)
+			return read_byte(hot.registers.hl);
+		else
+			return r8<code>();
 	}
 
-	inline u16 &r16stk(u8 code)
+	template <u8 code> inline void write_r8(u8 value)
 	{
-		switch (code & 0b11) {
-		case 0b00:
-			return registers.bc;
-		case 0b01:
-			return registers.de;
-		case 0b10:
-			return registers.hl;
-		default:
-			return registers.af;
-		}
+		if constexpr ((code & 0b111) == 0b110)
+			write_byte(hot.registers.hl, value);
+		else
+			r8<code>() = value;
 	}
 
-	inline bool cond(u8 code)
+	template <u8 code> inline u16 &r16()
 	{
-		switch (code & 0b11) {
-		case 0b00:
-			return !(registers.f & ZERO);
-		case 0b01:
-			return registers.f & ZERO;
-		case 0b10:
-			return !(registers.f & CARRY);
-		default:
-			return registers.f & CARRY;
-		}
+		if constexpr ((code & 0b11) == 0b00)
+			return hot.registers.bc;
+		else if constexpr ((code & 0b11) == 0b01)
+			return hot.registers.de;
+		else if constexpr ((code & 0b11) == 0b10)
+			return hot.registers.hl;
+		else
+			return hot.registers.sp;
+	}
+
+	template <u8 code> inline u8 read_r16mem()
+	{
+		if constexpr ((code & 0b11) == 0b00)
+			return read_byte(hot.registers.bc);
+		else if constexpr ((code & 0b11) == 0b01)
+			return read_byte(hot.registers.de);
+		else if constexpr ((code & 0b11) == 0b10)
+			return read_byte(hot.registers.hl++);
+		else
+			return read_byte(hot.registers.hl--);
+	}
+
+	template <u8 code> inline void write_r16mem(u8 value)
+	{
+		if constexpr ((code & 0b11) == 0b00)
+			write_byte(hot.registers.bc, value);
+		else if constexpr ((code & 0b11) == 0b01)
+			write_byte(hot.registers.de, value);
+		else if constexpr ((code & 0b11) == 0b10)
+			write_byte(hot.registers.hl++, value);
+		else
+			write_byte(hot.registers.hl--, value);
+	}
+
+	template <u8 code> inline u16 &r16stk()
+	{
+		if constexpr ((code & 0b11) == 0b00)
+			return hot.registers.bc;
+		else if constexpr ((code & 0b11) == 0b01)
+			return hot.registers.de;
+		else if constexpr ((code & 0b11) == 0b10)
+			return hot.registers.hl;
+		else
+			return hot.registers.af;
 	}
 
-	inline u8   b3(u8 value) { return (1 << (value & 0b111)); }
+	template <u8 code> inline bool cond()
+	{
+		if constexpr ((code & 0b11) == 0b00)
+			return !getZeroFlag();
+		else if constexpr ((code & 0b11) == 0b01)
+			return getZeroFlag();
+		else if constexpr ((code & 0b11) == 0b10)
+			return !getCarryFlag();
+		else
+			return getCarryFlag();
+	}
+
+	template <u8 code> static constexpr u8 b3 = 1 << (code & 0b111);
+
+	// 8-bit arithmetic on a, flags come from the tables in CPU.cpp
+	void        add(u8 value, u8 carry);
+	u8          sub(u8 value, u8 carry);
 
-	inline void push(u8 value) { write_byte(--registers.sp, value); }
+	inline void push(u8 value) { write_byte(--hot.registers.sp, value); }
 
-	inline u8   pop() { return read_byte(registers.sp++); }
+	inline u8   pop() { return read_byte(hot.registers.sp++); }
 
-	inline bool getZeroFlag() const { return registers.f & ZERO; }
-	inline bool getNegativeFlag() const { return registers.f & NEGATIVE; }
-	inline bool getHalfCarryFlag() const { return registers.f & HALF_CARRY; }
-	inline bool getCarryFlag() const { return registers.f & CARRY; }
+	void       materialize_flags();
 
-	inline void setZeroFlag(bool value)
+	inline u8 &flags()
 	{
-		registers.f = (registers.f & ~ZERO) | (value ? ZERO : 0);
+		if (hot.lazy.op != LAZY_NONE)
+			materialize_flags();
+		return hot.registers.f;
 	}
 
-	inline void setNegativeFlag(bool value)
+	inline void set_flags(u8 value)
 	{
-		registers.f = (registers.f & ~NEGATIVE) | (value ? NEGATIVE : 0);
+		hot.registers.f = value;
+		hot.lazy.op     = LAZY_NONE;
 	}
 
-	inline void setHalfCarryFlag(bool value)
+	inline void set_lazy_flags(LazyOp op, u8 left, u8 right, u16 result)
+	{
+		hot.lazy = {op, left, right, result};
+	}
+
+	// Z and C are cheap to derive from the pending operation, N and H are not
+	inline bool getZeroFlag() const
+	{
+		if (hot.lazy.op == LAZY_NONE)
+			return hot.registers.f & ZERO;
+		return (hot.lazy.result & 0xff) == 0;
+	}
+
+	inline bool getCarryFlag() const
+	{
+		if (hot.lazy.op == LAZY_NONE)
+			return hot.registers.f & CARRY;
+		if (hot.lazy.op >= LAZY_INC)
+			return hot.lazy.left & CARRY;
+		return hot.lazy.result > 0xff;
+	}
+
+	inline bool getNegativeFlag() { return flags() & NEGATIVE; }
+	inline bool getHalfCarryFlag() { return flags() & HALF_CARRY; }
+
+	inline void setZeroFlag(bool value) { flags() = (flags() & ~ZERO) | (value ? ZERO : 0); }
+
+	inline void setNegativeFlag(bool value)
 	{
-		registers.f = (registers.f & ~HALF_CARRY) | (value ? HALF_CARRY : 0);
+		flags() = (flags() & ~NEGATIVE) | (value ? NEGATIVE : 0);
 	}
 
-	inline void setCarryFlag(bool value)
+	inline void setHalfCarryFlag(bool value)
 	{
-		registers.f = (registers.f & ~CARRY) | (value ? CARRY : 0);
+		flags() = (flags() & ~HALF_CARRY) | (value ? HALF_CARRY : 0);
 	}
 
+	inline void setCarryFlag(bool value) { flags() = (flags() & ~CARRY) | (value ? CARRY : 0); }
+
 public:
 	CPU(GameBoy &);
 	virtual ~CPU();
-	void tick();
 
-	u8  &getInterruptFlags() { return interrupt_flags; }
-	u8  &getInterruptEnable() { return interrupt_enable; }
+	// Runs a whole instruction (or one halted machine cycle) and returns its cost in T-cycles
+	int  step();
+
+	// Called by the MMU before an access that depends on time or changes the code that runs
+	// next: gives the cycles deferred by a native block to the PPU and Timer, the block then
+	// stops after the current instruction
+	void catch_up();
+
+#ifdef GBMU_RECOMPILER
+	void loadNativeBlocks(const std::string &path) { cache.load_native(path); }
+
+	// Entry point of recompiled blocks: runs instructions whose bytes follow each other in bytes,
+	// opcodes above 0xff standing for 0xCB prefixed ones. Stops early where the interpreter
+	// would service an interrupt or an event before the next instruction
+	template <u16... opcodes> static void run_block(CPU &cpu, const u8 *bytes);
+#endif
+
+#ifdef GBMU_DYNAREC
+	// Whether ROM code is translated to machine code as it is first run (the default)
+	void setDynarecEnabled(bool enabled);
+#endif
+
+	// Start of the instruction being run, or the pc an interrupt is being serviced at
+	u16  getInstructionPC() const { return instruction_pc; }
+
+	u8  &getInterruptFlags() { return hot.interrupt_flags; }
+	u8  &getInterruptEnable() { return hot.interrupt_enable; }
+
+	enum Flag { ZERO = 1 << 7, NEGATIVE = 1 << 6, HALF_CARRY = 1 << 5, CARRY = 1 << 4 };
 
 	enum Interrupt {
 		VBLANK = 1 << 0,
@@ -229,7 +328,7 @@ public:
 		JOYPAD = 1 << 4
 	};
 
-	void requestInterrupt(enum Interrupt interrupt) { interrupt_flags |= interrupt; }
+	void requestInterrupt(enum Interrupt interrupt) { hot.interrupt_flags |= interrupt; }
 
 	u8   readIO(u16 address);
 	void writeIO(u16 address, u8 value);
@@ -0,0 +1,571 @@
+#pragma once
+
+#include <GBMU/CPU.hpp>
+#include <iostream>
+
+// Definitions of the opcode handlers, shared by the interpreter and ahead-of-time recompiled code
+
+namespace GBMU {
+
+// Z and C for an 8-bit addition, indexed by its 9-bit result
+inline constexpr std::array<u8, 0x200> ADD_FLAGS = [] {
+	std::array<u8, 0x200> flags{};
+	for (int sum = 0; sum < 0x200; sum++)
+		flags[sum] = ((sum & 0xff) == 0 ? CPU::ZERO : 0) | (sum > 0xff ? CPU::CARRY : 0);
+	return flags;
+}();
+
+// Z, N and C for an 8-bit subtraction, indexed by its 9-bit (borrow in bit 8) result
+inline constexpr std::array<u8, 0x200> SUB_FLAGS = [] {
+	std::array<u8, 0x200> flags{};
+	for (int diff = 0; diff < 0x200; diff++)
+		flags[diff] = ((diff & 0xff) == 0 ? CPU::ZERO : 0) | CPU::NEGATIVE |
+		              (diff > 0xff ? CPU::CARRY : 0);
+	return flags;
+}();
+
+// Z and H for inc r8, indexed by the result
+inline constexpr std::array<u8, 0x100> INC_FLAGS = [] {
+	std::array<u8, 0x100> flags{};
+	for (int result = 0; result < 0x100; result++)
+		flags[result] = (result == 0 ? CPU::ZERO : 0) | ((result & 0xF) == 0 ? CPU::HALF_CARRY : 0);
+	return flags;
+}();
+
+// Z, N and H for dec r8, indexed by the result
+inline constexpr std::array<u8, 0x100> DEC_FLAGS = [] {
+	std::array<u8, 0x100> flags{};
+	for (int result = 0; result < 0x100; result++)
+		flags[result] = (result == 0 ? CPU::ZERO : 0) | CPU::NEGATIVE |
+		                ((result & 0xF) == 0xF ? CPU::HALF_CARRY : 0);
+	return flags;
+}();
+
+// Z for any result
+inline constexpr std::array<u8, 0x100> ZERO_FLAGS = [] {
+	std::array<u8, 0x100> flags{};
+	flags[0] = CPU::ZERO;
+	return flags;
+}();
+
+// New af for daa, indexed by a and the N, H and C flags (bits 8 to 10)
+inline constexpr std::array<u16, 0x800> DAA = [] {
+	std::array<u16, 0x800> af{};
+
+	for (int index = 0; index < 0x800; index++) {
+		u8   a          = index;
+		u8   flags      = (index >> 4) & (CPU::NEGATIVE | CPU::HALF_CARRY | CPU::CARRY);
+		u8   correction = 0;
+		bool negative   = flags & CPU::NEGATIVE;
+
+		if ((flags & CPU::HALF_CARRY) || (!negative && (a & 0x0F) > 0x09))
+			correction |= 0x06;
+		if ((flags & CPU::CARRY) || (!negative && a > 0x99)) {
+			correction |= 0x60;
+			flags      |= CPU::CARRY;
+		}
+
+		a          = negative ? a - correction : a + correction;
+		flags     &= ~CPU::HALF_CARRY;
+		af[index]  = (a << 8) | flags | (a == 0 ? CPU::ZERO : 0);
+	}
+
+	return af;
+}();
+
+template <u8 opcode> void CPU::execute()
+{
+	// nop
+	if constexpr (opcode == 0x00) {
+	}
+
+	// ld r16, imm16
+	else if constexpr ((opcode & 0xCF) == 0x01)
+		r16<(opcode >> 4)>() = imm16();
+
+	// ld [r16mem], a
+	else if constexpr ((opcode & 0xCF) == 0x02)
+		write_r16mem<(opcode >> 4)>(hot.registers.a);
+
+	// ld a, [r16mem]
+	else if constexpr ((opcode & 0xCF) == 0x0A)
+		hot.registers.a = read_r16mem<(opcode >> 4)>();
+
+	// ld [imm16], sp
+	else if constexpr (opcode == 0x08) {
+		u16 address = imm16();
+		write_byte(address, hot.registers.sp & 0x00FF);
+		write_byte(address + 1, (hot.registers.sp & 0xFF00) >> 8);
+	}
+
+	// inc r16
+	else if constexpr ((opcode & 0xCF) == 0x03) {
+		u16 &reg = r16<(opcode >> 4)>();
+		set_r16(reg, reg + 1);
+	}
+
+	// dec r16
+	else if constexpr ((opcode & 0xCF) == 0x0B) {
+		u16 &reg = r16<(opcode >> 4)>();
+		set_r16(reg, reg - 1);
+	}
+
+	// add hl, r16
+	else if constexpr ((opcode & 0xCF) == 0x09) {
+		u16 value  = r16<(opcode >> 4)>();
+		u32 result = hot.registers.hl + value;
+		setNegativeFlag(false);
+		setHalfCarryFlag((hot.registers.hl & 0x0FFF) + (value & 0x0FFF) > 0x0FFF);
+		setCarryFlag(result > 0xFFFF);
+		set_r16(hot.registers.hl, static_cast<u16>(result));
+	}
+
+	// inc r8
+	else if constexpr ((opcode & 0xC7) == 0x04) {
+		u8 result   = read_r8<(opcode >> 3)>() + 1;
+		write_r8<(opcode >> 3)>(result);
+		set_lazy_flags(LAZY_INC, getCarryFlag() ? CARRY : 0, 0, result);
+	}
+
+	// dec r8
+	else if constexpr ((opcode & 0xC7) == 0x05) {
+		u8 result   = read_r8<(opcode >> 3)>() - 1;
+		write_r8<(opcode >> 3)>(result);
+		set_lazy_flags(LAZY_DEC, getCarryFlag() ? CARRY : 0, 0, result);
+	}
+
+	// ld r8, imm8
+	else if constexpr ((opcode & 0xC7) == 0x06)
+		write_r8<(opcode >> 3)>(imm8());
+
+	// rlca
+	else if constexpr (opcode == 0x07) {
+		bool carry      = (hot.registers.a & 0x80) != 0;
+		hot.registers.a = (hot.registers.a << 1) | (carry ? 1 : 0);
+		set_flags(carry ? CARRY : 0);
+	}
+
+	// rrca
+	else if constexpr (opcode == 0x0F) {
+		bool carry      = (hot.registers.a & 0x01) != 0;
+		hot.registers.a = (hot.registers.a >> 1) | (carry ? 0x80 : 0);
+		set_flags(carry ? CARRY : 0);
+	}
+
+	// rla
+	else if constexpr (opcode == 0x17) {
+		bool carry      = (hot.registers.a & 0x80) != 0;
+		hot.registers.a = (hot.registers.a << 1) | (getCarryFlag() ? 1 : 0);
+		set_flags(carry ? CARRY : 0);
+	}
+
+	// rra
+	else if constexpr (opcode == 0x1F) {
+		bool carry      = (hot.registers.a & 0x01) != 0;
+		hot.registers.a = (hot.registers.a >> 1) | (getCarryFlag() ? 0x80 : 0);
+		set_flags(carry ? CARRY : 0);
+	}
+
+	// daa
+	else if constexpr (opcode == 0x27)
+		hot.registers.af = DAA[hot.registers.a | (flags() & (NEGATIVE | HALF_CARRY | CARRY)) << 4];
+
+	// cpl
+	else if constexpr (opcode == 0x2F) {
+		hot.registers.a = ~hot.registers.a;
+		setNegativeFlag(true);
+		setHalfCarryFlag(true);
+	}
+
+	// scf
+	else if constexpr (opcode == 0x37) {
+		setNegativeFlag(false);
+		setHalfCarryFlag(false);
+		setCarryFlag(true);
+	}
+
+	// ccf
+	else if constexpr (opcode == 0x3F) {
+		setNegativeFlag(false);
+		setHalfCarryFlag(false);
+		setCarryFlag(!getCarryFlag());
+	}
+
+	// jr imm8
+	else if constexpr (opcode == 0x18) {
+		s8 offset = static_cast<s8>(imm8());
+		set_r16(hot.registers.pc, hot.registers.pc + offset);
+	}
+
+	// jr cond, imm8
+	else if constexpr ((opcode & 0xE7) == 0x20) {
+		s8 offset = static_cast<s8>(imm8());
+		if (cond<(opcode >> 3)>())
+			set_r16(hot.registers.pc, hot.registers.pc + offset);
+	}
+
+	// stop
+	else if constexpr (opcode == 0x10)
+		std::cerr << "STOP instr called" << std::endl;
+
+	// halt
+	else if constexpr (opcode == 0x76)
+		hot.halted = true;
+
+	// ld r8, r8
+	else if constexpr ((opcode & 0xC0) == 0x40)
+		write_r8<(opcode >> 3)>(read_r8<opcode>());
+
+	// add a, r8
+	else if constexpr ((opcode & 0xF8) == 0x80)
+		add(read_r8<opcode>(), 0);
+
+	// adc a, r8
+	else if constexpr ((opcode & 0xF8) == 0x88)
+		add(read_r8<opcode>(), getCarryFlag());
+
+	// sub a, r8
+	else if constexpr ((opcode & 0xF8) == 0x90)
+		hot.registers.a = sub(read_r8<opcode>(), 0);
+
+	// sbc a, r8
+	else if constexpr ((opcode & 0xF8) == 0x98)
+		hot.registers.a = sub(read_r8<opcode>(), getCarryFlag());
+
+	// and a, r8
+	else if constexpr ((opcode & 0xF8) == 0xA0) {
+		hot.registers.a &= read_r8<opcode>();
+		set_lazy_flags(LAZY_LOGIC, HALF_CARRY, 0, hot.registers.a);
+	}
+
+	// xor a, r8
+	else if constexpr ((opcode & 0xF8) == 0xA8) {
+		hot.registers.a ^= read_r8<opcode>();
+		set_lazy_flags(LAZY_LOGIC, 0, 0, hot.registers.a);
+	}
+
+	// or a, r8
+	else if constexpr ((opcode & 0xF8) == 0xB0) {
+		hot.registers.a |= read_r8<opcode>();
+		set_lazy_flags(LAZY_LOGIC, 0, 0, hot.registers.a);
+	}
+
+	// cp a, r8
+	else if constexpr ((opcode & 0xF8) == 0xB8)
+		sub(read_r8<opcode>(), 0);
+
+	// add a, imm8
+	else if constexpr (opcode == 0xC6)
+		add(imm8(), 0);
+
+	// adc a, imm8
+	else if constexpr (opcode == 0xCE)
+		add(imm8(), getCarryFlag());
+
+	// sub a, imm8
+	else if constexpr (opcode == 0xD6)
+		hot.registers.a = sub(imm8(), 0);
+
+	// sbc a, imm8
+	else if constexpr (opcode == 0xDE)
+		hot.registers.a = sub(imm8(), getCarryFlag());
+
+	// and a, imm8
+	else if constexpr (opcode == 0xE6) {
+		hot.registers.a &= imm8();
+		set_lazy_flags(LAZY_LOGIC, HALF_CARRY, 0, hot.registers.a);
+	}
+
+	// xor a, imm8
+	else if constexpr (opcode == 0xEE) {
+		hot.registers.a ^= imm8();
+		set_lazy_flags(LAZY_LOGIC, 0, 0, hot.registers.a);
+	}
+
+	// or a, imm8
+	else if constexpr (opcode == 0xF6) {
+		hot.registers.a |= imm8();
+		set_lazy_flags(LAZY_LOGIC, 0, 0, hot.registers.a);
+	}
+
+	// cp a, imm8
+	else if constexpr (opcode == 0xFE)
+		sub(imm8(), 0);
+
+	// ret cond
+	else if constexpr ((opcode & 0xE7) == 0xC0) {
+		hot.ticks += 4; // I don't know why but it takes an extra 4 cycles
+		            // https://gist.github.com/SonoSooS/c0055300670d678b5ae8433e20bea595#ret-cc
+		if (cond<(opcode >> 3)>()) {
+			u8 low  = pop();
+			u8 high = pop();
+			set_r16(hot.registers.pc, low | (high << 8));
+		}
+	}
+
+	// ret
+	else if constexpr (opcode == 0xC9) {
+		u8 low  = pop();
+		u8 high = pop();
+		set_r16(hot.registers.pc, low | (high << 8));
+	}
+
+	// reti
+	else if constexpr (opcode == 0xD9) {
+		u8 low  = pop();
+		u8 high = pop();
+		set_r16(hot.registers.pc, low | (high << 8));
+		hot.ime = 1;
+	}
+
+	// jp cond, imm16
+	else if constexpr ((opcode & 0xE7) == 0xC2) {
+		u16 address = imm16();
+		if (cond<(opcode >> 3)>()) {
+			set_r16(hot.registers.pc, address);
+		}
+	}
+
+	// jp imm16
+	else if constexpr (opcode == 0xC3) {
+		u16 address = imm16();
+		set_r16(hot.registers.pc, address);
+	}
+
+	// jp hl
+	else if constexpr (opcode == 0xE9)
+		hot.registers.pc = hot.registers.hl;
+
+	// call cond, imm16
+	else if constexpr ((opcode & 0xE7) == 0xC4) {
+		u16 address = imm16();
+		if (cond<(opcode >> 3)>()) {
+			push(hot.registers.pc >> 8);
+			push(hot.registers.pc);
+			set_r16(hot.registers.pc, address);
+		}
+	}
+
+	// call imm16
+	else if constexpr (opcode == 0xCD) {
+		u16 address = imm16();
+		push(hot.registers.pc >> 8);
+		push(hot.registers.pc);
+		set_r16(hot.registers.pc, address);
+	}
+
+	// rst tgt3
+	else if constexpr ((opcode & 0xC7) == 0xC7) {
+		push(hot.registers.pc >> 8);
+		push(hot.registers.pc);
+		set_r16(hot.registers.pc, opcode & 0b00111000);
+	}
+
+	// pop r16stk
+	else if constexpr ((opcode & 0xCF) == 0xC1) {
+		u8   low  = pop();
+		u8   high = pop();
+		u16 &reg  = r16stk<(opcode >> 4)>();
+		reg       = low | (high << 8);
+		if constexpr (opcode == 0xF1) // pop af: lower 4 bits of F are always 0
+			set_flags(hot.registers.f & 0xF0);
+	}
+
+	// push r16stk
+	else if constexpr ((opcode & 0xCF) == 0xC5) {
+		hot.ticks += TICKS_PER_CYCLES; // Internal delay before the stack writes
+		if constexpr (opcode == 0xF5)
+			flags();
+		u16 value = r16stk<(opcode >> 4)>();
+		push(value >> 8);
+		push(value);
+	}
+
+	// prefix
+	else if constexpr (opcode == 0xCB)
+		CB_OPCODES[imm8()](*this);
+
+	// ldh [c], a
+	else if constexpr (opcode == 0xE2)
+		write_byte(0xFF00 + hot.registers.c, hot.registers.a);
+
+	// ldh [imm8], a
+	else if constexpr (opcode == 0xE0)
+		write_byte(0xFF00 + imm8(), hot.registers.a);
+
+	// ld [imm16], a
+	else if constexpr (opcode == 0xEA)
+		write_byte(imm16(), hot.registers.a);
+
+	// ldh a, [c]
+	else if constexpr (opcode == 0xF2)
+		hot.registers.a = read_byte(0xFF00 + hot.registers.c);
+
+	// ldh a, [imm8]
+	else if constexpr (opcode == 0xF0)
+		hot.registers.a = read_byte(0xFF00 + imm8());
+
+	// ld a, [imm16]
+	else if constexpr (opcode == 0xFA)
+		hot.registers.a = read_byte(imm16());
+
+	// add sp, imm8
+	else if constexpr (opcode == 0xE8) {
+		hot.ticks += 4;
+		s8  offset = static_cast<s8>(imm8());
+		u16 result = hot.registers.sp + offset;
+		setZeroFlag(false);
+		setNegativeFlag(false);
+		setHalfCarryFlag((hot.registers.sp & 0x0F) + (offset & 0x0F) > 0x0F);
+		setCarryFlag((hot.registers.sp & 0xFF) + (offset & 0xFF) > 0xFF);
+		set_r16(hot.registers.sp, static_cast<u16>(result));
+	}
+
+	// ld hl, sp + imm8
+	else if constexpr (opcode == 0xF8) {
+		s8  offset = static_cast<s8>(imm8());
+		u16 result = hot.registers.sp + offset;
+		setZeroFlag(false);
+		setNegativeFlag(false);
+		setHalfCarryFlag((hot.registers.sp & 0x0F) + (offset & 0x0F) > 0x0F);
+		setCarryFlag((hot.registers.sp & 0xFF) + (offset & 0xFF) > 0xFF);
+		set_r16(hot.registers.hl, static_cast<u16>(result));
+	}
+
+	// ld sp, hl
+	else if constexpr (opcode == 0xF9)
+		set_r16(hot.registers.sp, hot.registers.hl);
+
+	// di
+	else if constexpr (opcode == 0xF3)
+		hot.ime = 0;
+
+	// ei
+	else if constexpr (opcode == 0xFB)
+		hot.enable_interrupt_delay = true;
+
+	// No instructions
+	else if constexpr (opcode == 0xD3 || opcode == 0xDB || opcode == 0xDD || opcode == 0xE3 ||
+	                   opcode == 0xE4 || opcode == 0xEB || opcode == 0xEC || opcode == 0xED ||
+	                   opcode == 0xF4 || opcode == 0xFC || opcode == 0xFD) {
+	}
+
+	else
+		static_assert(opcode != opcode, "Unknown instruction");
+}
+
+template <u8 opcode> void CPU::execute_cb()
+{
+	// rlc r8
+	if constexpr ((opcode & 0xF8) == 0x00) {
+		u8   reg    = read_r8<opcode>();
+		bool carry  = (reg & 0x80) != 0;
+		u8   result = (reg << 1) | (carry ? 1 : 0);
+		write_r8<opcode>(result);
+		set_flags(ZERO_FLAGS[result] | (carry ? CARRY : 0));
+	}
+
+	// rrc r8
+	else if constexpr ((opcode & 0xF8) == 0x08) {
+		u8   reg    = read_r8<opcode>();
+		bool carry  = (reg & 0x01) != 0;
+		u8   result = (reg >> 1) | (carry ? 0x80 : 0);
+		write_r8<opcode>(result);
+		set_flags(ZERO_FLAGS[result] | (carry ? CARRY : 0));
+	}
+
+	// rl r8
+	else if constexpr ((opcode & 0xF8) == 0x10) {
+		u8   reg    = read_r8<opcode>();
+		bool carry  = (reg & 0x80) != 0;
+		u8   result = (reg << 1) | (getCarryFlag() ? 1 : 0);
+		write_r8<opcode>(result);
+		set_flags(ZERO_FLAGS[result] | (carry ? CARRY : 0));
+	}
+
+	// rr r8
+	else if constexpr ((opcode & 0xF8) == 0x18) {
+		u8   reg    = read_r8<opcode>();
+		bool carry  = reg & 1;
+		u8   result = (reg >> 1) | (getCarryFlag() ? 0x80 : 0);
+		write_r8<opcode>(result);
+		set_flags(ZERO_FLAGS[result] | (carry ? CARRY : 0));
+	}
+
+	// sla r8
+	else if constexpr ((opcode & 0xF8) == 0x20) {
+		u8   reg    = read_r8<opcode>();
+		bool carry  = (reg & 0x80) != 0;
+		u8   result = reg << 1;
+		write_r8<opcode>(result);
+		set_flags(ZERO_FLAGS[result] | (carry ? CARRY : 0));
+	}
+
+	// sra r8
+	else if constexpr ((opcode & 0xF8) == 0x28) {
+		u8   reg    = read_r8<opcode>();
+		bool carry  = (reg & 0x01) != 0;
+		u8   result = (reg >> 1) | (reg & 0x80);
+		write_r8<opcode>(result);
+		set_flags(ZERO_FLAGS[result] | (carry ? CARRY : 0));
+	}
+
+	// swap r8
+	else if constexpr ((opcode & 0xF8) == 0x30) {
+		u8 reg    = read_r8<opcode>();
+		u8 result = ((reg & 0x0F) << 4) | ((reg & 0xF0) >> 4);
+		write_r8<opcode>(result);
+		set_flags(ZERO_FLAGS[result]);
+	}
+
+	// srl r8
+	else if constexpr ((opcode & 0xF8) == 0x38) {
+		u8   reg    = read_r8<opcode>();
+		bool carry  = (reg & 0x01) != 0;
+		u8   result = reg >> 1;
+		write_r8<opcode>(result);
+		set_flags(ZERO_FLAGS[result] | (carry ? CARRY : 0));
+	}
+
+	// bit b3, r8
+	else if constexpr ((opcode & 0xC0) == 0x40) {
+		u8 value    = read_r8<opcode>() & b3<(opcode >> 3)>;
+		set_flags((getCarryFlag() ? CARRY : 0) | HALF_CARRY | ZERO_FLAGS[value]);
+	}
+
+	// res b3, r8
+	else if constexpr ((opcode & 0xC0) == 0x80) {
+		u8 value = read_r8<opcode>();
+		write_r8<opcode>(value & ~b3<(opcode >> 3)>);
+	}
+
+	// set b3, r8
+	else {
+		u8 value = read_r8<opcode>();
+		write_r8<opcode>(value | b3<(opcode >> 3)>);
+	}
+}
+
+#ifdef GBMU_RECOMPILER
+template <u16 opcode> bool CPU::execute_native()
+{
+	instruction_pc = hot.registers.pc;
+	imm8();
+	if constexpr (opcode > 0xff) {
+		imm8();
+		execute_cb<opcode & 0xff>();
+	} else
+		execute<opcode>();
+
+	return next_native();
+}
+
+template <u16... opcodes> void CPU::run_block(CPU &cpu, const u8 *bytes)
+{
+	cpu.prefetch = bytes;
+	(cpu.execute_native<opcodes>() && ...);
+	cpu.prefetch = nullptr;
+}
+#endif
+
+} // namespace GBMU
@@ -1,6 +1,11 @@
 #pragma once
 
+#include <GBMU/CartridgeHeader.hpp>
+#include <GBMU/Mappers.hpp>
+#include <GBMU/RomImage.hpp>
+#include <chrono>
 #include <cstddef>
+#include <memory>
 #include <string>
 #include <types.h>
 #include <vector>
@@ -9,44 +14,86 @@ namespace GBMU {
 
 class Cartridge {
 private:
-	std::vector<u8>          rom_data;
-	size_t                   rom_size;
-	u8                      *ram = nullptr;
-	size_t                   ram_size;
+	std::shared_ptr<const RomImage> rom;
+	const u8                       *rom_data; // Those of rom, for the accessors
+	size_t                          rom_size;
+	CartridgeHeader                 header;
+	std::vector<u8>                 ram;        // Private, the save file is written from a copy
+	std::vector<u8>                 saved_file; // Content of the last save submitted
+	size_t                          ram_size;
+	size_t                          save_size; // The RAM then the MBC3 clock, 0 without a save
 
-	u8                       rom_bank     = 1;
-	u8                       ram_bank     = 0;
-	bool                     ram_enabled  = false;
-	u8                       banking_mode = 0;
+	Mapper                          mapper; // Chosen once from the cartridge type
+	u16                             rom_bank0 = 0;
+	u16                             rom_bank  = 1;
 
-	static const std::string saves_folder_path;
-	std::string              save_file_path;
+	std::vector<u8>                 last_bank; // Copy of a partial last bank, padded with 0xff
 
-	static const std::string CARTRIDGE_TYPES[256];
+	const u8                       *rom_bank0_data; // Selected banks, recomputed only when
+	const u8                       *rom_bank_data;  // the mapper registers change
+	const u8                       *ram_bank_read;
+	u8                             *ram_bank_write;
+
+	static const std::string        saves_folder_path;
+	std::string                     save_file_path;
+
+	void                            update_banks();
+	void                            save();
+	void                            migrate_legacy_save();
+
+	// When poll_save next compares the RAM with the last save
+	std::chrono::steady_clock::time_point next_save;
+	static std::chrono::milliseconds      save_interval;
 
 public:
-	Cartridge(const std::string &filename);
+	// With a patch file, the patched ROM is used, and its fingerprint names the save
+	Cartridge(const std::string &filename, const std::string &patch_filename = "");
 	virtual ~Cartridge();
 
-	std::string getTitle() const;
-	u8          getCartridgeType() const;
-	std::string getCartridgeTypeString() const;
-	u8          getRomSize() const;
-	u8          getRamSize() const;
-	u8          getLicenseCode() const;
-	u8          getHeaderChecksum() const;
-	u16         getGlobalChecksum() const;
+	const CartridgeHeader &getHeader() const { return header; }
+
+	// Shorthands for the fields of the header
+	std::string getTitle() const { return header.getTitle(); }
+	u8          getCartridgeType() const { return header.getCartridgeType(); }
+	std::string getCartridgeTypeString() const { return header.getCartridgeTypeString(); }
+	u8          getRomSize() const { return header.getRomSize(); }
+	u8          getRamSize() const { return header.getRamSize(); }
+	u8          getLicenseCode() const { return header.getLicenseCode(); }
+	u8          getHeaderChecksum() const { return header.getHeaderChecksum(); }
+	u16         getGlobalChecksum() const { return header.getGlobalChecksum(); }
 
 	const char *getSaveFilePath();
 
-	u8         *getRomData();
 	const u8   *getRomData() const;
 
 	size_t      getRomDataSize() const;
 	size_t      getRamDataSize() const;
+	const u8   *getRamData() const { return ram.data(); }
+
+	// ROM banks mapped at 0x0000-0x3fff and 0x4000-0x7fff
+	u16         getRomBank0() const { return rom_bank0; }
+	u16         getRomBank() const { return rom_bank; }
+
+	// Host memory of a whole ROM bank, or null past the end of the file. A last bank the file
+	// only covers in part is served from a copy, padded the way reads past the end return
+	const u8 *getRomBankData(u16 bank) const;
+	// The same for the bank mapped at 0x0000-0x3fff, only MBC1 ever switches it
+	const u8 *getSelectedRomBank0() const { return rom_bank0_data; }
+	// Switchable ROM bank and RAM bank currently selected, the open-bus page when there is none.
+	// The RAM bank is null when the mapper itself answers (MBC2 RAM, MBC3 clock)
+	const u8 *getSelectedRomBank() const { return rom_bank_data; }
+	const u8 *getSelectedRamBank() const { return ram_bank_read; }
+	// The same RAM bank for writes, or null while the RAM is disabled
+	u8       *getWritableRamBank() const { return ram_bank_write; }
+
+	u8        read_byte(u16 address);
+	void      write_byte(u16 address, u8 value);
+
+	// Saves the RAM if it changed, at most once per save interval. Called once per frame
+	void      poll_save();
 
-	u8          read_byte(u16 address);
-	void        write_byte(u16 address, u8 value);
+	// Interval between saves of every cartridge, GBMU_SAVE_INTERVAL_MS by default
+	static void setSaveInterval(std::chrono::milliseconds interval);
 };
 
 } // namespace GBMU
@@ -0,0 +1,46 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <types.h>
+
+namespace GBMU {
+
+// The 0x100-0x14f area of a ROM: entry point, logo, title and the description of the cartridge.
+// It is read on its own, without the rest of the ROM, and kept as is in ROM indexes. Bytes past
+// the end of a short ROM read as zero
+class CartridgeHeader {
+public:
+	static constexpr u16 START = 0x100;
+	static constexpr u16 SIZE  = 0x50;
+
+private:
+	u8 bytes[SIZE] = {};
+
+	u8 at(u16 address) const { return bytes[address - START]; }
+
+public:
+	CartridgeHeader() = default;
+	CartridgeHeader(const u8 *rom, size_t rom_size);
+
+	// Reads only the header of a ROM file
+	static CartridgeHeader read(int fd);
+	static CartridgeHeader read(const std::string &filename);
+
+	std::string            getTitle() const;
+	u8                     getCartridgeType() const { return at(0x147); }
+	std::string            getCartridgeTypeString() const;
+	u8                     getRomSize() const { return at(0x148); }
+	u8                     getRamSize() const { return at(0x149); }
+	u8                     getLicenseCode() const { return at(0x14b); }
+	u8                     getHeaderChecksum() const { return at(0x14d); }
+	u16                    getGlobalChecksum() const { return at(0x14e) << 8 | at(0x14f); }
+
+	// What the boot ROM checks: the sum of 0x134-0x14c against the header checksum
+	u8                     computeHeaderChecksum() const;
+	bool                   isHeaderChecksumValid() const;
+	// Sum of every byte of the ROM but the global checksum itself. Nothing checks it on hardware
+	static u16             computeGlobalChecksum(const u8 *rom, size_t rom_size);
+};
+
+} // namespace GBMU
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <GBMU/BlockCache.hpp>
+#include <cstddef>
+#include <types.h>
+#include <vector>
+
+namespace GBMU {
+
+class CPU;
+class MMU;
+
+// Translates hot blocks of the block cache to x86-64 machine code. The CPU runs them in one step,
+// like the blocks of the ahead-of-time recompiler, and they stop at the same points (see
+// CPU::next_native). Common instructions are inlined on the HotState, with the fast path of the
+// memory map; the others, and fused ones, call their interpreter handler
+class Dynarec {
+public:
+	using Native = void (*)(CPU &);
+
+	static constexpr size_t CODE_CAPACITY = 16 << 20; // Translation stops once full
+
+private:
+	// Two views of the same pages, so that no page is ever both writable and executable
+	u8                 *code;
+	u8                 *code_writable;
+	size_t              code_size = 0;
+
+	// Offsets from the HotState, which generated code keeps in rbx. Everything lives in the
+	// GameBoy, so they are the same for every instance
+	int                 hot;            // From the CPU
+	int                 cpu;
+	int                 mmu;
+	int                 caught_up;
+	int                 native_budget;
+	int                 deferred_cycles;
+	int                 instruction_pc;
+	int                 read_pages;
+	int                 write_pages;
+
+	// Block being translated
+	std::vector<u8>     out;
+	std::vector<size_t> exits;               // rel32 jumps to the epilogue
+	u16                 instruction_address; // Of the instruction being translated
+	int                 pending_ticks;       // Cycles not added to hot.ticks yet
+	bool                full_check;          // Whether the instruction changed more than ticks
+
+	// Helpers called by generated code
+	static u8           read_slow(MMU *mmu, u16 address);
+	static void         write_slow(MMU *mmu, u16 address, u8 value);
+	static void         materialize_flags(CPU *cpu);
+	static void         run_handler(CPU *cpu, const BlockCache::Instruction *instruction);
+
+	// Encoding
+	void                byte(u8 value);
+	void                dword(u32 value);
+	void                mem(u8 reg, int offset);
+	void                load8(u8 reg, int offset);
+	void                load16(u8 reg, int offset);
+	void                load32(u8 reg, int offset);
+	void                store8(int offset, u8 reg);
+	void                store16(int offset, u8 reg);
+	void                store32(int offset, u8 reg);
+	void                store8i(int offset, u8 value);
+	void                store16i(int offset, u16 value);
+	void                add16i(int offset, s8 value);
+	void                add32i(int offset, int value);
+	void                cmp8i(int offset, u8 value);
+	void                alu(u8 opcode, u8 dst, u8 src);
+	void                alui(u8 ext, u8 reg, int value);
+	void                shift(u8 ext, u8 reg, u8 count);
+	void                movi(u8 reg, u32 value);
+	void                mov(u8 dst, u8 src);
+	void                movzx8(u8 dst, u8 src);
+	void                sete(u8 reg);
+	void                scratch_store(u8 reg, u8 slot);
+	void                scratch_load(u8 reg, u8 slot);
+	void                lea_rdi(int offset);
+	void                call(const void *function);
+	size_t              jump(u8 condition); // Returns where to bind() its target
+	void                bind(size_t jump);
+	void                exit_if(u8 condition);
+
+	// Emulation
+	void                tick(int cycles);
+	void                flush_ticks();
+	void                read();
+	void                write();
+	void                push();
+	void                pop();
+	void                read_r8(u8 code);
+	void                write_r8(u8 code);
+	void                carry();
+	void                zero();
+	void                condition(u8 code);
+	void                materialize();
+	void                arithmetic(u8 operation);
+	void                next_native();
+
+	bool                inlined(const BlockCache::Instruction &instruction);
+	void                fallback(const BlockCache::Instruction &instruction, u16 address);
+	void                translate(const BlockCache::Instruction &instruction, u16 address);
+	void                translate_cb(u8 opcode);
+
+public:
+	Dynarec(CPU &, MMU &);
+	virtual ~Dynarec();
+
+	// Machine code of a decoded block, or nullptr once the code buffer is full
+	Native compile(const BlockCache::Block &block);
+};
+
+} // namespace GBMU
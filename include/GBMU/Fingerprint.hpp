@@ -0,0 +1,41 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <types.h>
+
+namespace GBMU {
+
+// 128-bit content hash of a ROM, not cryptographic: it names save files and finds copies of a ROM,
+// nothing relies on it against a forged file
+struct Fingerprint {
+	u64         low  = 0;
+	u64         high = 0;
+
+	bool        operator==(const Fingerprint &) const = default;
+
+	std::string hex() const;
+	static bool parse(const std::string &hex, Fingerprint &fingerprint);
+};
+
+// Fingerprint of data fed in any number of pieces. Four independent lanes of 8 bytes keep the
+// multipliers busy, the whole thing runs at memory speed
+class FingerprintHasher {
+private:
+	u64    lanes[4];
+	u8     buffer[32]; // Bytes of an incomplete stripe
+	size_t buffered = 0;
+	u64    total    = 0;
+
+	void   consume(const u8 *stripe);
+
+public:
+	FingerprintHasher();
+
+	void        update(const u8 *data, size_t size);
+	Fingerprint finish() const;
+
+	static Fingerprint hash(const u8 *data, size_t size);
+};
+
+} // namespace GBMU
@@ -3,8 +3,10 @@
 #include <GBMU/APU.hpp>
 #include <GBMU/CPU.hpp>
 #include <GBMU/Cartridge.hpp>
+#include <GBMU/HotState.hpp>
 #include <GBMU/Joypad.hpp>
 #include <GBMU/MMU.hpp>
+#include <GBMU/MemoryArena.hpp>
 #include <GBMU/PPU.hpp>
 #include <GBMU/Serial.hpp>
 #include <GBMU/Timer.hpp>
@@ -12,12 +14,15 @@
 #include <string>
 #include <thread>
 
-#define EMULATION_SPEED 1
+#define EMULATION_SPEED  1
+#define CYCLES_PER_FRAME 70224
 
 namespace GBMU {
 
 class GameBoy {
 private:
+	HotState          hot; // Own cache line (alignas), first to only pad after the vptr
+	MemoryArena       arena;
 	Cartridge         cartridge;
 	MMU               mmu;
 	APU               apu;
@@ -32,25 +37,38 @@ private:
 
 	bool              speedup{false};
 
+	u64               frames = 0; // Frames computed since power on
+
 	void              pollEvents();
 
 public:
-	GameBoy(const std::string &);
+	GameBoy(const std::string &, const std::string &patch_filename = "");
 	virtual ~GameBoy();
 
-	void       run();
-	void       stop();
+	void         run();
+	void         stop();
+
+	void         compute_frame();
+	// One CPU step, then the PPU and Timer brought up to date. Returns its cost in T-cycles
+	int          step();
+	// Gives cycles the CPU ran to the PPU and Timer
+	void         advance(int cycles);
 
-	void       compute_frame();
+	HotState    &getHotState() { return hot; }
+	MemoryArena &getArena() { return arena; }
+	APU         &getAPU() { return apu; }
+	PPU         &getPPU() { return ppu; }
+	Cartridge   &getCartridge() { return cartridge; }
+	MMU         &getMMU() { return mmu; }
+	CPU         &getCPU() { return cpu; }
+	Serial      &getSerial() { return serial; }
+	Timer       &getTimer() { return timer; }
+	Joypad      &getJoypad() { return joypad; }
 
-	APU       &getAPU() { return apu; }
-	PPU       &getPPU() { return ppu; }
-	Cartridge &getCartridge() { return cartridge; }
-	MMU       &getMMU() { return mmu; }
-	CPU       &getCPU() { return cpu; }
-	Serial    &getSerial() { return serial; }
-	Timer     &getTimer() { return timer; }
-	Joypad    &getJoypad() { return joypad; }
+	// Cycles the emulation can skip without missing an interrupt or the end of the frame
+	int cyclesUntilNextEvent();
+	// Cycles since power on, up to the memory access being made in the current CPU step
+	u64 elapsedCycles() const;
 };
 
 } // namespace GBMU
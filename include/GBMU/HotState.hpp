@@ -0,0 +1,69 @@
+#pragma once
+
+#include <types.h>
+
+namespace GBMU {
+
+// SM83 registers, pairs of 8-bit registers can also be used as one 16-bit register
+struct Registers {
+#define REGISTER_PAIR(low, high, word)                                                             \
+	union {                                                                                        \
+		struct {                                                                                   \
+			u8 low;                                                                                \
+			u8 high;                                                                               \
+		};                                                                                         \
+		u16 word;                                                                                  \
+	}
+
+	REGISTER_PAIR(f, a, af);
+	REGISTER_PAIR(c, b, bc);
+	REGISTER_PAIR(e, d, de);
+	REGISTER_PAIR(l, h, hl);
+
+#undef REGISTER_PAIR
+
+	u16 sp;
+	u16 pc;
+};
+
+// Last flag-setting ALU operation, F is only computed when something reads all of it
+enum LazyOp : u8 { LAZY_NONE, LAZY_ADD, LAZY_SUB, LAZY_INC, LAZY_DEC, LAZY_LOGIC };
+
+struct LazyFlags {
+	u8  op     = LAZY_NONE;
+	u8  left   = 0; // First operand (add/sub), or the flags known upfront (inc/dec/logic)
+	u8  right  = 0; // Second operand (add/sub)
+	u16 result = 0; // Result, with the carry or borrow in bit 8 for add/sub
+};
+
+// Everything touched on each emulated instruction, owned by GameBoy and used in place by the
+// CPU, PPU and Timer so that it all fits in a single cache line
+struct alignas(64) HotState {
+	Registers registers{};
+	LazyFlags lazy;
+	int       ticks                  = 0;
+	u8        interrupt_flags        = 0;
+	u8        interrupt_enable       = 0;
+	u8        ime                    = 0;
+	bool      enable_interrupt_delay = false;
+	bool      halted                 = false;
+	bool      watching               = false; // Whether watchpoints need single stepping
+
+	int       ppu_cycles             = 0;
+	u8        lcdc                   = 0x91; // LCDC - LCD Control
+	u8        stat                   = 0x02; // STAT - LCD Status (OAM search)
+	u8        ly                     = 0x00; // LY - LCD Y-Coordinate
+	u8        lyc                    = 0x00; // LYC - LY Compare
+
+	u16       div_counter            = 0;
+	u8        tima                   = 0x00; // TIMA - Timer counter
+	u8        tma                    = 0x00; // TMA - Timer modulo
+	u8        tac                    = 0x00; // TAC - Timer control
+	int       timer_counter          = 0;
+
+	int       frame_cycles           = 0; // Cycles already run into the next frame
+};
+
+static_assert(sizeof(HotState) == 64, "HotState should fit in one cache line");
+
+} // namespace GBMU
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <types.h>
+
+namespace GBMU {
+
+// Hex MD5 digest of data. Only old save files are named after it, to find them again
+std::string md5_hex(const u8 *data, size_t size);
+
+} // namespace GBMU
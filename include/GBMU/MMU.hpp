@@ -5,38 +5,148 @@
 #include <cstdint>
 #include <functional>
 #include <types.h>
+#include <vector>
 
 namespace GBMU {
 
 class GameBoy;
 
+// The address space is split in 256-byte pages. Pages backed by host memory (ROM banks, RAM) are
+// accessed through a direct pointer, the others go to the handler registered for them
 class MMU {
+	friend class Dynarec;
+
 public:
-	using ReadHandler  = std::function<u8(u16)>;
-	using WriteHandler = std::function<void(u16, u8)>;
+	using ReadHandler               = std::function<u8(u16)>;
+	using WriteHandler              = std::function<void(u16, u8)>;
+
+	static constexpr int PAGE_SHIFT = 8;
+	static constexpr int PAGE_SIZE  = 1 << PAGE_SHIFT;
+	static constexpr int PAGE_MASK  = PAGE_SIZE - 1;
+	static constexpr int PAGE_COUNT = 0x10000 >> PAGE_SHIFT;
+
+	enum Watch : u8 {
+		WATCH_READ = 1 << 0,
+		WATCH_WRITE   = 1 << 1,
+		WATCH_EXECUTE = 1 << 2,
+	};
+
+	struct WatchpointHit {
+		u16 address;
+		u16 pc;    // Start of the instruction that made the access
+		u8  value; // Value read or written, or the opcode executed
+		u64 cycle; // Cycles since power on
+		u8  kind;  // One of the Watch flags
+	};
+
+	using WatchpointCallback = std::function<void(const WatchpointHit &)>;
 
 private:
-	GameBoy                          &gb;
+	struct Handler {
+		ReadHandler  read;
+		WriteHandler write;
+	};
+
+	struct Watchpoint {
+		u16 start;
+		u16 end;
+		u8  kinds;
+	};
+
+	// Set in page_handlers when the page is shared by several handlers, the other bits then
+	// index split_pages
+	static constexpr u8 SPLIT_PAGE = 0x80;
+
+	GameBoy            &gb;
+
+	// Fast path, the mapped memory of the page unless it is watched
+	std::array<const u8 *, PAGE_COUNT>     read_pages{};
+	std::array<u8 *, PAGE_COUNT>           write_pages{};
+
+	std::array<const u8 *, PAGE_COUNT>     mapped_reads{};  // Host memory of the page, or null
+	std::array<u8 *, PAGE_COUNT>           mapped_writes{}; // Host memory of the page, or null
+	std::array<u8, PAGE_COUNT>             page_handlers{}; // Handler index, or SPLIT_PAGE | index
+	std::vector<std::array<u8, PAGE_SIZE>> split_pages;     // Handler index of each byte
+	std::vector<Handler>                   handlers;        // Handler 0 is none, reads return 0xff
 
-	std::array<ReadHandler, 0x10000>  read_handlers;
-	std::array<WriteHandler, 0x10000> write_handlers;
+	std::vector<Watchpoint>                watchpoints;
+	std::array<u8, PAGE_COUNT>             watched_pages{}; // Watch flags of the page's watchpoints
+	WatchpointCallback                     watchpoint_callback;
 
-	u8                                bios_disabled = 0;
-	u8                                wram[0x2000];
-	u8                                eram[0x2000];
-	u8                                io_registers[0x80];
-	u8                                hram[0x7F];
+	u8                                     bios_disabled = 0;
+	u8                                    *wram; // In the GameBoy's memory arena, like HRAM
+	u8                                    *hram;
+
+	u8                                     handlerAt(u16 address) const;
+
+	u8                                     read_unwatched(u16 address);
+	u8                                     read_slow(u16 address);
+	void                                   write_slow(u16 address, u8 value);
+
+	void                                   update_page(int page);
+	void                                   update_watched_pages();
+	void                                   report_watchpoints(u16 address, u8 value, u8 kind);
+
+#ifdef GBMU_INSTRUMENT_MMU
+	// Accesses per 16-byte line, per I/O register and per switchable ROM bank, dumped on
+	// destruction to find the regions worth a fast path
+	std::array<u64, 0x1000> line_reads{};
+	std::array<u64, 0x1000> line_writes{};
+	std::array<u64, 0x100>  io_reads{};
+	std::array<u64, 0x100>  io_writes{};
+	std::vector<u64>        bank_reads;
+
+	void                    count_read(u16 address);
+	void                    count_write(u16 address);
+	void                    dump_heatmap();
+#endif
 
 public:
 	MMU(GameBoy &);
 	virtual ~MMU();
 
-	u8   read_byte(u16 address);
-	void write_byte(u16 address, u8 value);
+	inline u8 read_byte(u16 address)
+	{
+#ifdef GBMU_INSTRUMENT_MMU
+		count_read(address);
+#endif
+		if (const u8 *page = read_pages[address >> PAGE_SHIFT])
+			return page[address & PAGE_MASK];
+		return read_slow(address);
+	}
 
+	inline void write_byte(u16 address, u8 value)
+	{
+#ifdef GBMU_INSTRUMENT_MMU
+		count_write(address);
+#endif
+		if (u8 *page = write_pages[address >> PAGE_SHIFT])
+			page[address & PAGE_MASK] = value;
+		else
+			write_slow(address, value);
+	}
+
+	bool isBiosMapped() const { return bios_disabled == 0; }
+
+	// Points whole pages from start to end at host memory, a null pointer sends that kind of
+	// access back to the handlers
+	void map_memory(u16 start, u16 end, const u8 *read, u8 *write);
+	// Maps the boot ROM and the current ROM and RAM banks, after the cartridge switched them
+	void map_cartridge();
+
+	// Handlers replace any host memory mapped over the pages they cover
 	void register_handler(u16 address, ReadHandler read_handler, WriteHandler write_handler);
 	void register_handler_range(u16 start, u16 end, ReadHandler read_handler,
 	                            WriteHandler write_handler);
+
+	// Only the pages of watched ranges leave the fast path, hits are reported to the callback
+	void add_watchpoint(u16 start, u16 end, u8 kinds);
+	void remove_watchpoint(u16 start, u16 end);
+	void clear_watchpoints();
+	void set_watchpoint_callback(WatchpointCallback callback);
+
+	// Called by the CPU before each instruction while watchpoints need single stepping
+	void check_execute(u16 address);
 };
 
 } // namespace GBMU
@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstddef>
+#include <ctime>
+#include <types.h>
+#include <variant>
+
+namespace GBMU {
+
+// Memory bank controllers. The cartridge picks one at load and calls it through std::visit, so
+// every register write is a direct call into the mapper of the cartridge type
+//
+// ramBank() tells the cartridge what 0xa000-0xbfff maps: a RAM bank, nothing (open bus), or
+// registers of the mapper itself, which go through read_ram and write_ram
+static constexpr int RAM_DISABLED = -1;
+static constexpr int RAM_MAPPER   = -2;
+
+// Cartridges without a mapper, and the defaults of the others
+struct RomOnly {
+	void write_register(u16, u8) {}
+
+	u16  romBank0() const { return 0; }
+	u16  romBank() const { return 1; }
+	int  ramBank() const { return 0; }
+
+	u8   read_ram(const u8 *, size_t, u16) const { return 0xff; }
+	void write_ram(u8 *, size_t, u16, u8) {}
+};
+
+struct MBC1 : RomOnly {
+	bool ram_enabled = false;
+	u8   bank1       = 1; // Low 5 bits of the ROM bank, never 0
+	u8   bank2       = 0; // High 2 bits of the ROM bank, or the RAM bank
+	u8   mode        = 0; // 1 applies bank2 to 0x0000-0x3fff and to the RAM as well
+
+	void write_register(u16 address, u8 value);
+
+	u16  romBank0() const { return mode ? bank2 << 5 : 0; }
+	u16  romBank() const { return bank2 << 5 | bank1; }
+	int  ramBank() const { return ram_enabled ? (mode ? bank2 : 0) : RAM_DISABLED; }
+};
+
+// 512 half-bytes of RAM built into the mapper, repeated over 0xa000-0xbfff
+struct MBC2 : RomOnly {
+	static constexpr size_t RAM_SIZE    = 0x200;
+
+	bool                    ram_enabled = false;
+	u8                      rom_bank    = 1;
+
+	void                    write_register(u16 address, u8 value);
+
+	u16                     romBank() const { return rom_bank; }
+	int                     ramBank() const { return ram_enabled ? RAM_MAPPER : RAM_DISABLED; }
+
+	u8                      read_ram(const u8 *ram, size_t ram_size, u16 address) const;
+	void                    write_ram(u8 *ram, size_t ram_size, u16 address, u8 value);
+};
+
+// RAM banks 0x00-0x03, or the real time clock registers 0x08-0x0c, which count host time. Reads
+// see the values latched by writing 0x00 then 0x01 to 0x6000-0x7fff
+struct MBC3 : RomOnly {
+	enum { RTC_S, RTC_M, RTC_H, RTC_DL, RTC_DH };
+
+	// Trailer of the save file after the RAM, as other emulators write it: the clock registers and
+	// the latched ones, 32 bits each, then the host time the clock registers were taken at, 64
+	// bits, all little endian
+	static constexpr size_t RTC_SAVE_SIZE = 48;
+
+	bool                    rtc         = false; // MBC3+TIMER, only those save the clock
+	bool                    ram_enabled = false;
+	u8                      rom_bank    = 1;
+	u8                      ram_bank    = 0;
+	u8                      latch       = 0xff; // Last value written to 0x6000-0x7fff
+	u8                      latched[5]  = {};
+
+	u64                     rtc_seconds = 0; // Clock value at rtc_sync, days included
+	time_t                  rtc_sync    = time(nullptr); // Kept while halted
+	bool                    rtc_halted  = false;
+	bool                    rtc_carry   = false; // Day counter overflowed past 511
+
+	void                    write_register(u16 address, u8 value);
+
+	u16                     romBank() const { return rom_bank; }
+	int                     ramBank() const;
+
+	u8                      read_ram(const u8 *ram, size_t ram_size, u16 address) const;
+	void                    write_ram(u8 *ram, size_t ram_size, u16 address, u8 value);
+
+	// The time of a running clock is saved as the one it read zero at, so that the trailer only
+	// changes when the game sets or halts the clock
+	void                    save_rtc(u8 trailer[RTC_SAVE_SIZE]) const;
+	void                    load_rtc(const u8 trailer[RTC_SAVE_SIZE]);
+	// Whether two trailers hold the same clock. The latched registers change whenever the game
+	// reads the clock, they don't count
+	static bool             same_rtc(const u8 a[RTC_SAVE_SIZE], const u8 b[RTC_SAVE_SIZE]);
+
+private:
+	void        sync_rtc();
+	void        read_rtc(u8 registers[5]);
+	void        write_rtc(const u8 registers[5]);
+	static void to_registers(u64 seconds, u8 flags, u8 registers[5]);
+};
+
+struct MBC5 : RomOnly {
+	bool ram_enabled = false;
+	u16  rom_bank    = 1; // 9 bits, bank 0 can be selected
+	u8   ram_bank    = 0;
+
+	void write_register(u16 address, u8 value);
+
+	u16  romBank() const { return rom_bank; }
+	int  ramBank() const { return ram_enabled ? ram_bank : RAM_DISABLED; }
+};
+
+using Mapper = std::variant<RomOnly, MBC1, MBC2, MBC3, MBC5>;
+
+// Mapper of a cartridge type byte (0x147 in the header). Unsupported mappers get RomOnly
+Mapper select_mapper(u8 cartridge_type);
+
+} // namespace GBMU
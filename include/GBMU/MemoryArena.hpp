@@ -0,0 +1,29 @@
+#pragma once
+
+#include <cstddef>
+#include <types.h>
+
+namespace GBMU {
+
+// Emulated memory of one Game Boy (VRAM, WRAM, OAM, wave RAM and HRAM) in a single zeroed block,
+// laid out in address order from 0x8000 so that a save state only has to copy it. ROM and
+// cartridge RAM are banked and stay with the cartridge
+class MemoryArena {
+public:
+	static constexpr u16    BASE = 0x8000;
+	static constexpr size_t SIZE = 0x8000;
+
+private:
+	u8 *memory;
+
+public:
+	MemoryArena();
+	virtual ~MemoryArena();
+
+	u8       *at(u16 address) { return memory + (address - BASE); }
+
+	u8       *data() { return memory; }
+	const u8 *data() const { return memory; }
+};
+
+} // namespace GBMU
@@ -0,0 +1,93 @@
+#pragma once
+
+#include <array>
+#include <types.h>
+
+namespace GBMU {
+
+// Static properties of the SM83 instruction set, used to predecode ROM code
+
+// Length in bytes, opcode included (the 0xCB page counts its second byte as an operand)
+constexpr std::array<u8, 0x100> INSTRUCTION_LENGTHS = [] {
+	std::array<u8, 0x100> lengths{};
+
+	for (int opcode = 0; opcode < 0x100; opcode++) {
+		if ((opcode & 0xCF) == 0x01 || opcode == 0x08 || (opcode & 0xE7) == 0xC2 ||
+		    opcode == 0xC3 || (opcode & 0xE7) == 0xC4 || opcode == 0xCD || opcode == 0xEA ||
+		    opcode == 0xFA)
+			lengths[opcode] = 3;
+		else if ((opcode & 0xC7) == 0x06 || opcode == 0x18 || (opcode & 0xE7) == 0x20 ||
+		         (opcode & 0xC7) == 0xC6 || opcode == 0xCB || opcode == 0xE0 || opcode == 0xF0 ||
+		         opcode == 0xE8 || opcode == 0xF8)
+			lengths[opcode] = 2;
+		else
+			lengths[opcode] = 1;
+	}
+
+	return lengths;
+}();
+
+// Cost in T-cycles when no branch is taken (0xCB is the cost of the prefix alone)
+constexpr std::array<u8, 0x100> INSTRUCTION_CYCLES = [] {
+	std::array<u8, 0x100> cycles{};
+
+	for (int opcode = 0; opcode < 0x100; opcode++) {
+		u8 memory = 0; // Extra machine cycles spent on [hl]
+
+		if (opcode >= 0x40 && opcode < 0xC0 && opcode != 0x76)
+			memory = ((opcode & 0x07) == 0x06 || (opcode & 0xF8) == 0x70) ? 1 : 0;
+
+		if (opcode == 0x08)
+			cycles[opcode] = 20;
+		else if (opcode == 0xC3 || opcode == 0xC9 || opcode == 0xD9 || opcode == 0xE8 ||
+		         opcode == 0xEA || opcode == 0xFA || (opcode & 0xCF) == 0xC5 ||
+		         (opcode & 0xC7) == 0xC7 || opcode == 0xCD)
+			cycles[opcode] = opcode == 0xCD ? 24 : 16;
+		else if ((opcode & 0xCF) == 0x01 || opcode == 0x34 || opcode == 0x35 || opcode == 0x36 ||
+		         (opcode & 0xE7) == 0xC2 || (opcode & 0xE7) == 0xC4 || (opcode & 0xCF) == 0xC1 ||
+		         opcode == 0x18 || opcode == 0xE0 || opcode == 0xF0 || opcode == 0xF8)
+			cycles[opcode] = 12;
+		else if ((opcode & 0xCF) == 0x02 || (opcode & 0xCF) == 0x0A || (opcode & 0xC7) == 0x03 ||
+		         (opcode & 0xCF) == 0x09 || (opcode & 0xC7) == 0x06 || (opcode & 0xE7) == 0x20 ||
+		         (opcode & 0xC7) == 0xC6 || (opcode & 0xE7) == 0xC0 || opcode == 0xE2 ||
+		         opcode == 0xF2 || opcode == 0xF9)
+			cycles[opcode] = 8;
+		else
+			cycles[opcode] = 4 + memory * 4;
+	}
+
+	return cycles;
+}();
+
+// Cost in T-cycles when the branch is taken (same as INSTRUCTION_CYCLES for the others)
+constexpr std::array<u8, 0x100> INSTRUCTION_CYCLES_TAKEN = [] {
+	std::array<u8, 0x100> cycles = INSTRUCTION_CYCLES;
+
+	for (int opcode = 0; opcode < 0x100; opcode++) {
+		if ((opcode & 0xE7) == 0x20 || (opcode & 0xE7) == 0xC2)
+			cycles[opcode] += 4;
+		else if ((opcode & 0xE7) == 0xC4 || (opcode & 0xE7) == 0xC0)
+			cycles[opcode] += 12;
+	}
+
+	return cycles;
+}();
+
+// Cost in T-cycles of the second byte of a 0xCB prefixed instruction
+constexpr u8 cb_instruction_cycles(u8 opcode)
+{
+	if ((opcode & 0x07) != 0x06)
+		return 4;
+	return (opcode & 0xC0) == 0x40 ? 8 : 12;
+}
+
+// Whether the instruction may move the PC anywhere else than right after itself
+constexpr bool is_branch(u8 opcode)
+{
+	return opcode == 0x18 || (opcode & 0xE7) == 0x20 || opcode == 0xC3 || (opcode & 0xE7) == 0xC2 ||
+	       opcode == 0xE9 || opcode == 0xCD || (opcode & 0xE7) == 0xC4 || opcode == 0xC9 ||
+	       opcode == 0xD9 || (opcode & 0xE7) == 0xC0 || (opcode & 0xC7) == 0xC7 ||
+	       opcode == 0x76 || opcode == 0x10;
+}
+
+} // namespace GBMU
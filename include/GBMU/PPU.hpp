@@ -1,5 +1,6 @@
 #pragma once
 
+#include <GBMU/HotState.hpp>
 #include <SDL2/SDL.h>
 #include <array>
 #include <span>
@@ -19,7 +20,7 @@ private:
 	SDL_Window                                   *window   = nullptr;
 	SDL_Renderer                                 *renderer = nullptr;
 	SDL_Texture                                  *texture  = nullptr;
-	std::array<u32, SCREEN_WIDTH * SCREEN_HEIGHT> framebuffer;
+	std::array<u32, SCREEN_WIDTH * SCREEN_HEIGHT> framebuffer{};
 
 	enum Mode { HBLANK = 0, VBLANK = 1, OAM_SEARCH = 2, PIXEL_TRANSFER = 3 };
 
@@ -36,21 +37,16 @@ private:
 
 	enum STAT { MODE0 = 1 << 3, MODE1 = 1 << 4, MODE2 = 1 << 5, LYC = 1 << 6 };
 
-	int        cycles            = 0;
-	bool       scanline_rendered = false;
-
-	u8         lcdc              = 0x91;             // LCDC - LCD Control
-	u8         stat              = Mode::OAM_SEARCH; // STAT - LCD Status
-	u8         scy               = 0x00;             // SCY - Scroll Y
-	u8         scx               = 0x00;             // SCX - Scroll X
-	u8         ly                = 0x00;             // LY - LCD Y-Coordinate
-	u8         lyc               = 0x00;             // LYC - LY Compare
-	u8         dma               = 0x00;             // DMA - OAM DMA Transfer
-	u8         bgp               = 0xFC;             // BGP - BG Palette Data
-	u8         obp0              = 0xFF;             // OBP0 - Object Palette 0 Data
-	u8         obp1              = 0xFF;             // OBP1 - Object Palette 1 Data
-	u8         wy                = 0x00;             // WY - Window Y Position
-	u8         wx                = 0x00;             // WX - Window X Position minus 7
+	HotState  &hot; // Mode cycles, LCDC, STAT, LY and LYC
+
+	u8         scy  = 0x00; // SCY - Scroll Y
+	u8         scx  = 0x00; // SCX - Scroll X
+	u8         dma  = 0x00; // DMA - OAM DMA Transfer
+	u8         bgp  = 0xFC; // BGP - BG Palette Data
+	u8         obp0 = 0xFF; // OBP0 - Object Palette 0 Data
+	u8         obp1 = 0xFF; // OBP1 - Object Palette 1 Data
+	u8         wy   = 0x00; // WY - Window Y Position
+	u8         wx   = 0x00; // WX - Window X Position minus 7
 
 	inline u16 compute_tile_address(u8 tile_index);
 
@@ -62,7 +58,18 @@ private:
 
 	std::span<struct Sprite> sprites;
 
-	void                     perform_dma();
+	// Tile data decoded to a color index per byte, 8 bytes a row: the row at VRAM offset
+	// address is at address * 4. Tiles written since the last scanline are decoded again before
+	// the next one
+	static constexpr int TILE_COUNT = 384;
+
+	std::array<u8, TILE_COUNT * 64>  tiles{};
+	std::array<u8, TILE_COUNT * 64>  flipped_tiles{}; // Mirrored horizontally, for sprites
+	std::array<u64, TILE_COUNT / 64> dirty_tiles;     // A bit per tile
+
+	void                             update_tiles();
+	void                             perform_dma();
+	void                             render_scanline();
 
 	int                      i = 8; // my favorite <3
 
@@ -70,20 +77,23 @@ public:
 	PPU(GameBoy &);
 	virtual ~PPU();
 
-	void                   tick();
-	void                   render();
+	void                  tick(int cycles);
+	int                   cyclesUntilNextEvent() const; // Next mode or LY change
+	int                   cyclesSinceLastEvent() const;
+	void                  render();
 
-	u8                     read_byte(u16 address);
-	void                   write_byte(u16 address, u8 value);
+	u8                    read_byte(u16 address);
+	void                  write_byte(u16 address, u8 value);
 
-	SDL_Window            *getWindow() const { return window; }
-	SDL_Renderer          *getRenderer() const { return renderer; }
-	SDL_Texture           *getTexture() const { return texture; }
+	SDL_Window           *getWindow() const { return window; }
+	SDL_Renderer         *getRenderer() const { return renderer; }
+	SDL_Texture          *getTexture() const { return texture; }
+	const u32            *getFramebuffer() const { return framebuffer.data(); }
 
-	std::array<u8, 0x2000> vram;
-	std::array<u8, 0xA0>   oam;
+	std::span<u8, 0x2000> vram; // In the GameBoy's memory arena
+	std::span<u8, 0xA0>   oam;
 
-	void                   rotate_palette();
+	void                  rotate_palette();
 };
 
 } // namespace GBMU
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <GBMU/Fingerprint.hpp>
+#include <cstddef>
+#include <memory>
+#include <string>
+#include <types.h>
+
+namespace GBMU {
+
+// Read-only mapping of a ROM file. Every cartridge of the process loading the same file, or a
+// file with the same content, shares one image
+class RomImage {
+private:
+	const u8   *data;
+	size_t      size;
+	Fingerprint fingerprint;
+
+public:
+	// Fingerprints of the files already seen, by path, size and modification time
+	static const std::string fingerprint_cache_path;
+
+	RomImage(const u8 *data, size_t size, const Fingerprint &fingerprint);
+	virtual ~RomImage();
+
+	static std::shared_ptr<const RomImage> load(const std::string &filename);
+	// The image of a ROM with an IPS or BPS patch applied. It maps the ROM file again, privately:
+	// the pages the patch touches are copied, the others stay shared with the page cache
+	static std::shared_ptr<const RomImage> load(const std::string &filename,
+	                                            const std::string &patch_filename);
+
+	const u8                              *getData() const { return data; }
+	size_t                                 getSize() const { return size; }
+	const Fingerprint                     &getFingerprint() const { return fingerprint; }
+};
+
+} // namespace GBMU
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <GBMU/CartridgeHeader.hpp>
+#include <cstddef>
+#include <string>
+#include <string_view>
+#include <types.h>
+
+namespace GBMU {
+
+// Headers of every ROM under a directory, in a file meant to be mapped as is: a fixed-size entry
+// per ROM, sorted by path relative to the directory, then the paths. Looking a ROM up is a binary
+// search over the mapping, nothing is parsed. The file is in host byte order
+class RomIndex {
+public:
+	enum Flags : u8 {
+		HEADER_CHECKSUM_VALID   = 1,
+		GLOBAL_CHECKSUM_CHECKED = 2, // Reads the whole ROM, only when asked for
+		GLOBAL_CHECKSUM_VALID   = 4,
+	};
+
+	struct Entry {
+		u32             path_offset; // In the path table, not null terminated
+		u32             path_length;
+		u64             size;
+		s64             mtime; // Nanoseconds, with size tells whether the file changed
+		CartridgeHeader header;
+		u8              flags;
+		u8              padding[7];
+	};
+
+	static constexpr char MAGIC[8] = {'G', 'B', 'M', 'U', 'I', 'D', 'X', '1'};
+
+	// Headers are stored as they are read
+	static_assert(sizeof(CartridgeHeader) == CartridgeHeader::SIZE);
+
+private:
+	struct FileHeader {
+		char magic[8];
+		u32  count;
+		u32  paths_size;
+	};
+
+	const u8    *mapping = nullptr;
+	size_t       mapping_size;
+	const Entry *entries = nullptr;
+	const char  *paths;
+	u32          count = 0;
+
+public:
+	// Maps an index, an empty one if the file doesn't exist
+	RomIndex(const std::string &index_path);
+	virtual ~RomIndex();
+
+	// Indexes the ROMs (.gb, .gbc, .sgb) under directory with a pool of threads, each reading only
+	// the headers. Entries of an existing index are kept for the files that didn't change, returns
+	// the number of files read
+	static size_t    build(const std::string &directory, const std::string &index_path,
+	                       unsigned threads, bool global_checksums);
+
+	u32              size() const { return count; }
+	const Entry     &at(u32 index) const { return entries[index]; }
+	std::string_view pathOf(const Entry &entry) const;
+
+	// Entry of a path relative to the indexed directory, or null
+	const Entry *find(std::string_view path) const;
+};
+
+} // namespace GBMU
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <cstddef>
+#include <string>
+#include <types.h>
+#include <vector>
+
+namespace GBMU {
+
+// IPS or BPS patch (translations, fixes), applied to a ROM image when a cartridge loads
+class RomPatch {
+public:
+	enum class Format { IPS, BPS };
+
+private:
+	std::vector<u8> data;
+	Format          format;
+
+	void            apply_ips(u8 *target, size_t target_size) const;
+	void            apply_bps(const u8 *source, size_t source_size, u8 *target,
+	                          size_t target_size) const;
+
+public:
+	// Reads a patch and checks its format, and its own checksum for BPS
+	RomPatch(const std::string &filename);
+
+	// Patches are told from ROMs and other files by their extension
+	static bool isPatchFile(const std::string &filename);
+
+	const u8   *getData() const { return data.data(); }
+	size_t      getSize() const { return data.size(); }
+
+	// Size of the patched ROM. Throws if the patch was made for another ROM
+	size_t targetSize(const u8 *source, size_t source_size) const;
+
+	// Patches target, which holds a copy of source padded with zeros to target_size. Only bytes
+	// that change are written, so that a copy-on-write target copies the pages the patch touches
+	// and no other
+	void apply(const u8 *source, size_t source_size, u8 *target, size_t target_size) const;
+};
+
+} // namespace GBMU
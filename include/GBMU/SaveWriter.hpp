@@ -0,0 +1,46 @@
+#pragma once
+
+#include <condition_variable>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <thread>
+#include <types.h>
+#include <vector>
+
+namespace GBMU {
+
+// Writes the battery saves of every cartridge of the process from one background thread, so that
+// the emulation never waits on the save directory. Files are replaced atomically: the content goes
+// to a temporary file that is synced then renamed over the previous save
+class SaveWriter {
+private:
+	std::mutex                             mutex;
+	std::condition_variable                wake;    // Something was submitted, or the writer stops
+	std::condition_variable                idle;    // Nothing is pending or being written
+	std::map<std::string, std::vector<u8>> pending; // Latest content of each file, by path
+	std::set<std::string>                  failed;  // Files whose last write failed
+	bool                                   writing  = false;
+	bool                                   stopping = false;
+	std::thread                            thread;
+
+	SaveWriter();
+
+	void        run();
+	static bool write_file(const std::string &path, const std::vector<u8> &data);
+
+public:
+	virtual ~SaveWriter();
+
+	static SaveWriter &get();
+
+	// Queues the content of a save file, replacing any older content still waiting for that file
+	void               submit(const std::string &path, std::vector<u8> data);
+	// Whether the last write of a file failed, so that it is submitted again. Forgets the failure
+	bool               take_failure(const std::string &path);
+	// Waits until every submitted save is on disk
+	void               flush();
+};
+
+} // namespace GBMU
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <GBMU/HotState.hpp>
 #include <cstdint>
 #include <types.h>
 
@@ -9,22 +10,21 @@ class GameBoy;
 
 class Timer {
 private:
-	GameBoy &gb;
+	GameBoy  &gb;
+	HotState &hot; // DIV and TIMA counters, TMA and TAC
 
-	u16      div_counter   = 0;
+	u8        div = 0x00; // DIV (will be managed by div_counter)
 
-	u8       div           = 0x00; // DIV (will be managed by div_counter)
-	u8       tima          = 0x00; // TIMA - Timer counter
-	u8       tma           = 0x00; // TMA - Timer modulo
-	u8       tac           = 0x00; // TAC - Timer control
-
-	int      timer_counter = 0;
+	int       threshold() const; // Cycles per TIMA increment
 
 public:
 	Timer(GameBoy &);
 	virtual ~Timer();
 
-	void tick();
+	void tick(int cycles);
+	int  cyclesUntilOverflow() const;
+
+	u16  getDivCounter() const { return hot.div_counter; }
 	u8   read_byte(u16 address);
 	void write_byte(u16 address, u8 value);
 };
@@ -182,7 +182,7 @@ void APU::audioCallback(void *userdata, u8 *stream, int len)
 	}
 }
 
-APU::APU(GameBoy &_gb) : gb(_gb)
+APU::APU(GameBoy &_gb) : gb(_gb), wave_pattern(_gb.getArena().at(0xff30))
 {
 	SDL_Init(SDL_INIT_AUDIO);
 
@@ -0,0 +1,295 @@
+#include <GBMU/BlockCache.hpp>
+#include <GBMU/GameBoy.hpp>
+#include <GBMU/Opcodes.hpp>
+#include <algorithm>
+#ifdef GBMU_DYNAREC
+# include <GBMU/Dynarec.hpp>
+#endif
+#ifdef GBMU_RECOMPILER
+# include <dlfcn.h>
+# include <stdexcept>
+#endif
+
+using namespace GBMU;
+
+BlockCache::BlockCache(GameBoy &_gb)
+    : gb(&_gb), rom_data(_gb.getCartridge().getRomData()),
+      rom_size(_gb.getCartridge().getRomDataSize())
+{
+	banks.resize((rom_size + 0x3fff) / 0x4000);
+#ifdef GBMU_DYNAREC
+	dynarec = std::make_unique<Dynarec>(_gb.getCPU(), _gb.getMMU());
+#endif
+}
+
+BlockCache::BlockCache(const RomImage &rom)
+    : gb(nullptr), rom_data(rom.getData()), rom_size(rom.getSize())
+{
+	banks.resize((rom_size + 0x3fff) / 0x4000);
+}
+
+BlockCache::~BlockCache()
+{
+#ifdef GBMU_RECOMPILER
+	if (native_library)
+		dlclose(native_library);
+#endif
+}
+
+int BlockCache::bank(u16 address)
+{
+	if (address <= 0x3fff) {
+		if (address < 0x100 && gb->getMMU().isBiosMapped())
+			return -1;
+
+		u16 bank = gb->getCartridge().getRomBank0();
+		return bank < banks.size() ? bank : -1;
+	} else if (address <= 0x7fff) {
+		u16 bank = gb->getCartridge().getRomBank();
+		return bank < banks.size() ? bank : -1;
+	}
+
+	// WRAM, HRAM and friends can be rewritten at any time
+	return -1;
+}
+
+const BlockCache::Block *BlockCache::lookup(u16 address)
+{
+	int current = bank(address);
+	if (current < 0)
+		return nullptr;
+
+	return lookup(current, address);
+}
+
+const BlockCache::Block *BlockCache::lookup(u16 bank, u16 address)
+{
+	auto [it, inserted] = banks[bank].try_emplace(address);
+	Block &block        = it->second;
+
+	if (inserted) {
+		block.bank  = bank;
+		block.start = address;
+		decode(block);
+#ifdef GBMU_RECOMPILER
+		if (auto native = natives.find(bank << 16 | address); native != natives.end())
+			block.native = native->second;
+#endif
+	}
+
+	if (block.instructions.empty())
+		return nullptr;
+
+#ifdef GBMU_DYNAREC
+	// Blocks entered halfway through, after an early exit, are rarely run again. Polling loops
+	// are left to CPU::skip_idle_loop, which needs to see them run to their end
+	if (!block.native && !block.poll_address && dynarec && ++block.runs == DYNAREC_MIN_RUNS)
+		block.native = dynarec->compile(block);
+#endif
+
+	return &block;
+}
+
+u8 BlockCache::read_rom(u16 bank, u32 address)
+{
+	size_t offset = bank * 0x4000 + (address & 0x3fff);
+
+	return offset < rom_size ? rom_data[offset] : 0xff;
+}
+
+void BlockCache::decode(Block &block)
+{
+	// Instructions never straddle the end of the bank they started in
+	u32 limit    = block.start <= 0x3fff ? 0x4000 : 0x8000;
+	u32 address  = block.start;
+
+	block.cycles = 0;
+
+	while (block.instructions.size() < BLOCK_MAX_INSTRUCTIONS) {
+		Instruction instruction{};
+
+		instruction.bytes[0] = read_rom(block.bank, address);
+		instruction.length   = INSTRUCTION_LENGTHS[instruction.bytes[0]];
+
+		if (address + instruction.length > limit)
+			break;
+
+		for (u8 i = 1; i < instruction.length; i++)
+			instruction.bytes[i] = read_rom(block.bank, address + i);
+
+		instruction.handler = CPU::OPCODES[instruction.bytes[0]];
+		instruction.cycles  = INSTRUCTION_CYCLES[instruction.bytes[0]];
+		if (instruction.bytes[0] == 0xCB)
+			instruction.cycles += cb_instruction_cycles(instruction.bytes[1]);
+
+		block.instructions.push_back(instruction);
+		block.cycles += instruction.cycles;
+		address      += instruction.length;
+
+		if (is_branch(instruction.bytes[0]))
+			break;
+	}
+
+	block.end = address;
+
+	detect_idle_loop(block);
+#ifdef GBMU_FUSION
+	fuse(block);
+#endif
+}
+
+void BlockCache::detect_idle_loop(Block &block)
+{
+	// Looking for `ldh a, [reg]`, then `cp`/`and`/`bit` on a, branching back to that load
+	if (block.instructions.size() < 2)
+		return;
+
+	const Instruction &read = block.instructions.front();
+	const Instruction &jump = block.instructions.back();
+	u16                address;
+
+	if (read.bytes[0] == 0xF0)
+		address = 0xff00 + read.bytes[1];
+	else if (read.bytes[0] == 0xFA)
+		address = read.bytes[1] | (read.bytes[2] << 8);
+	else
+		return;
+
+	// Registers whose value only changes with time
+	if (address != 0xff04 && address != 0xff41 && address != 0xff44)
+		return;
+
+	for (size_t i = 1; i + 1 < block.instructions.size(); i++) {
+		const u8 *bytes = block.instructions[i].bytes;
+
+		if (bytes[0] != 0xFE && bytes[0] != 0xE6 && !(bytes[0] == 0xCB && (bytes[1] & 0xC7) == 0x47))
+			return;
+	}
+
+	u16 target;
+
+	if (jump.bytes[0] == 0x18 || (jump.bytes[0] & 0xE7) == 0x20)
+		target = block.end + static_cast<s8>(jump.bytes[1]);
+	else if (jump.bytes[0] == 0xC3 || (jump.bytes[0] & 0xE7) == 0xC2)
+		target = jump.bytes[1] | (jump.bytes[2] << 8);
+	else
+		return;
+
+	if (target != block.start)
+		return;
+
+	block.poll_address = address;
+	block.loop_cycles  = block.cycles - INSTRUCTION_CYCLES[jump.bytes[0]] +
+	                    INSTRUCTION_CYCLES_TAKEN[jump.bytes[0]];
+}
+
+#ifdef GBMU_FUSION
+void BlockCache::fuse(Block &block)
+{
+	std::vector<Instruction> fused;
+	auto                    &instructions = block.instructions;
+
+	for (size_t i = 0; i < instructions.size();) {
+		const CPU::Fusion *match = nullptr;
+
+		for (const CPU::Fusion &fusion : CPU::FUSIONS) {
+			if (i + fusion.count > instructions.size())
+				continue;
+
+			u8 length = 0;
+			for (u8 k = 0; k < fusion.count; k++)
+				length += instructions[i + k].length;
+			if (length > sizeof(Instruction::bytes))
+				continue;
+
+			u8 k = 0;
+			while (k < fusion.count && instructions[i + k].bytes[0] == fusion.opcodes[k])
+				k++;
+
+			if (k == fusion.count) {
+				match = &fusion;
+				break;
+			}
+		}
+
+		if (!match) {
+			fused.push_back(instructions[i++]);
+			continue;
+		}
+
+		// One instruction holding the bytes and cost of the whole sequence
+		Instruction instruction{};
+		instruction.handler = match->handler;
+
+		for (u8 k = 0; k < match->count; k++, i++) {
+			std::copy_n(instructions[i].bytes, instructions[i].length,
+			            instruction.bytes + instruction.length);
+			instruction.length += instructions[i].length;
+			instruction.cycles += instructions[i].cycles;
+		}
+
+		fused.push_back(instruction);
+	}
+
+	instructions = std::move(fused);
+}
+#endif
+
+#ifdef GBMU_RECOMPILER
+void BlockCache::load_native(const std::string &path)
+{
+	void *library = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+	if (!library)
+		throw std::runtime_error(dlerror());
+
+	auto blocks   = static_cast<const Native *>(dlsym(library, "gbmu_native_blocks"));
+	auto count    = static_cast<const size_t *>(dlsym(library, "gbmu_native_block_count"));
+	auto checksum = static_cast<const u16 *>(dlsym(library, "gbmu_native_global_checksum"));
+	auto rom      = static_cast<const size_t *>(dlsym(library, "gbmu_native_rom_size"));
+	auto cpu_size = static_cast<const size_t *>(dlsym(library, "gbmu_native_cpu_size"));
+
+	if (!blocks || !count || !checksum || !rom || !cpu_size) {
+		dlclose(library);
+		throw std::runtime_error(path + ": not generated by the recompiler");
+	}
+
+	if (*checksum != CartridgeHeader(rom_data, rom_size).getGlobalChecksum() || *rom != rom_size ||
+	    *cpu_size != sizeof(CPU)) {
+		dlclose(library);
+		throw std::runtime_error(path + ": generated for another ROM or with other GBMU_* options");
+	}
+
+	if (native_library)
+		dlclose(native_library);
+	native_library = library;
+
+	natives.clear();
+	for (size_t i = 0; i < *count; i++)
+		natives[blocks[i].bank << 16 | blocks[i].start] = blocks[i].run;
+
+	// Blocks may already be decoded, and referenced by the CPU
+	for (auto &bank : banks) {
+		for (auto &[start, block] : bank) {
+			auto native  = natives.find(block.bank << 16 | start);
+			block.native = native != natives.end() ? native->second : nullptr;
+#ifdef GBMU_DYNAREC
+			if (!block.native && dynarec && block.runs >= DYNAREC_MIN_RUNS)
+				block.native = dynarec->compile(block);
+#endif
+		}
+	}
+}
+#endif
+
+#ifdef GBMU_DYNAREC
+void BlockCache::setDynarecEnabled(bool enabled)
+{
+	if (enabled && !dynarec)
+		dynarec = std::make_unique<Dynarec>(gb->getCPU(), gb->getMMU());
+	else if (!enabled)
+		dynarec.reset();
+
+	for (auto &bank : banks)
+		bank.clear();
+}
+#endif
@@ -1,279 +1,302 @@
 #include <GBMU/Cartridge.hpp>
+#include <GBMU/MD5.hpp>
+#include <GBMU/SaveWriter.hpp>
+#include <algorithm>
+#include <array>
+#include <cctype>
 #include <cerrno>
 #include <cstring>
 #include <fcntl.h>
 #include <filesystem>
-#include <iomanip>
+#include <fstream>
 #include <iostream>
-#include <openssl/evp.h>
-#include <openssl/md5.h>
-#include <sstream>
-#include <sys/mman.h>
 #include <sys/stat.h>
 #include <types.h>
 #include <unistd.h>
 
 using namespace GBMU;
 
-const std::string Cartridge::saves_folder_path    = "saves";
-
-const std::string Cartridge::CARTRIDGE_TYPES[256] = {
-    "ROM ONLY",
-    "MBC1",
-    "MBC1+RAM",
-    "MBC1+RAM+BATTERY",
-    "MBC2",
-    "MBC2+BATTERY",
-    "ROM+RAM",
-    "ROM+RAM+BATTERY",
-    "MMM01",
-    "MMM01+RAM",
-    "MMM01+RAM+BATTERY",
-    "MBC3+TIMER+BATTERY",
-    "MBC3+TIMER+RAM+BATTERY",
-    "MBC3",
-    "MBC3+RAM",
-    "MBC3+RAM+BATTERY",
-    "MBC5",
-    "MBC5+RAM",
-    "MBC5+RAM+BATTERY",
-    "MBC5+RUMBLE",
-    "MBC5+RUMBLE+RAM",
-    "MBC5+RUMBLE+RAM+BATTERY",
-    "MBC6",
-    "MBC7+SENSOR+RUMBLE+RAM+BATTERY",
-    "MBC8",
-    "MBC8+RAM",
-    "MBC8+RAM+BATTERY",
-};
-
-Cartridge::Cartridge(const std::string &filename)
-{
-	int fd = open(filename.c_str(), O_RDONLY);
-	if (fd < 0) {
-		throw std::runtime_error(strerror(errno));
-	}
+#ifndef GBMU_SAVE_INTERVAL_MS
+# define GBMU_SAVE_INTERVAL_MS 1000
+#endif
 
-	struct stat sb;
-	if (fstat(fd, &sb) < 0) {
-		close(fd);
-		throw std::runtime_error(strerror(errno));
-	}
-
-	u8 *mapped = reinterpret_cast<u8 *>(mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0));
-	if (mapped == MAP_FAILED) {
-		close(fd);
-		throw std::runtime_error(strerror(errno));
-	}
+std::chrono::milliseconds Cartridge::save_interval(GBMU_SAVE_INTERVAL_MS);
 
-	rom_size = sb.st_size;
-	rom_data.resize(rom_size);
+const std::string Cartridge::saves_folder_path = "saves";
 
-	if (read(fd, rom_data.data(), rom_size) != rom_size) {
-		close(fd);
-		throw std::runtime_error(strerror(errno));
+Cartridge::Cartridge(const std::string &filename, const std::string &patch_filename)
+{
+	// The image may be shared with other cartridges of the process, only the RAM and the bank
+	// registers are this cartridge's own
+	rom      = patch_filename.empty() ? RomImage::load(filename)
+	                                  : RomImage::load(filename, patch_filename);
+	rom_data = rom->getData();
+	rom_size = rom->getSize();
+	header   = CartridgeHeader(rom_data, rom_size);
+	mapper   = select_mapper(getCartridgeType());
+
+	if (size_t partial = rom_size % 0x4000) {
+		last_bank.assign(0x4000, 0xff);
+		std::copy(rom_data + rom_size - partial, rom_data + rom_size, last_bank.begin());
 	}
 
-	close(fd);
+	ram_size   = getRamDataSize();
+	MBC3 *mbc3 = std::get_if<MBC3>(&mapper);
+	bool  rtc  = mbc3 && mbc3->rtc;
+	save_size  = ram_size + (rtc ? MBC3::RTC_SAVE_SIZE : 0);
 
-	if ((ram_size = getRamDataSize())) {
+	if (save_size) {
 		std::cout << "Save file: " << getSaveFilePath() << std::endl;
 
 		std::filesystem::create_directories(saves_folder_path);
+		migrate_legacy_save();
+
+		// The save file is only read here, the save writer replaces it with copies of the RAM
+		ram.resize(ram_size);
 
-		fd = open(getSaveFilePath(), O_RDWR | O_CREAT, 0644);
-		if (fd < 0) {
+		int fd = open(getSaveFilePath(), O_RDONLY);
+		if (fd < 0 && errno != ENOENT) {
 			throw std::runtime_error(strerror(errno));
 		}
 
-		struct stat save_sb;
-		if (fstat(fd, &save_sb) == 0 && save_sb.st_size != ram_size) {
-			if (ftruncate(fd, ram_size) < 0) {
-				close(fd);
-				throw std::runtime_error(strerror(errno));
+		std::vector<u8> file(save_size);
+		size_t          size = 0;
+		if (fd >= 0) {
+			while (size < save_size) {
+				ssize_t result = read(fd, file.data() + size, save_size - size);
+				if (result < 0 && errno == EINTR)
+					continue;
+				if (result <= 0)
+					break;
+				size += result;
 			}
-		}
-
-		ram =
-		    reinterpret_cast<u8 *>(mmap(NULL, ram_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
-		if (ram == MAP_FAILED) {
-			ram = nullptr;
 			close(fd);
-			throw std::runtime_error(strerror(errno));
 		}
+
+		// A shorter file leaves the rest of the RAM zeroed, and the clock at zero without its
+		// trailer
+		std::copy(file.begin(), file.begin() + ram_size, ram.begin());
+		if (rtc && size == save_size)
+			mbc3->load_rtc(file.data() + ram_size);
+
+		next_save = std::chrono::steady_clock::now() + save_interval;
+
+		// Started now so that it outlives the cartridge
+		SaveWriter::get();
 	}
-}
 
-Cartridge::~Cartridge()
-{
-	if (ram)
-		munmap(ram, ram_size);
+	update_banks();
+
+	// What the file holds, unless the clock was only just started
+	if (save_size) {
+		saved_file = ram;
+		saved_file.resize(save_size);
+		if (rtc)
+			mbc3->save_rtc(saved_file.data() + ram_size);
+	}
 }
 
-const char *Cartridge::getSaveFilePath()
+Cartridge::~Cartridge()
 {
-	if (save_file_path.empty()) {
-		EVP_MD_CTX   *context = EVP_MD_CTX_new();
-		const EVP_MD *md      = EVP_md5();
-		unsigned char md_value[EVP_MAX_MD_SIZE];
-		unsigned int  md_len;
-
-		EVP_DigestInit_ex2(context, md, NULL);
-		EVP_DigestUpdate(context, getRomData(), getRomDataSize());
-		EVP_DigestFinal_ex(context, md_value, &md_len);
-		EVP_MD_CTX_free(context);
-
-		std::stringstream ss;
-		for (unsigned int i = 0; i < md_len; i++)
-			ss << std::hex << std::setw(2) << std::setfill('0') << (int)md_value[i];
-
-		save_file_path = saves_folder_path + '/' + ss.str();
+	if (save_size) {
+		save();
+		SaveWriter::get().flush();
 	}
-
-	return save_file_path.c_str();
 }
 
-std::string Cartridge::getTitle() const
+void Cartridge::save()
 {
-	if (rom_size < 0x144 || rom_data.empty())
-		return "";
+	u8 rtc[MBC3::RTC_SAVE_SIZE];
+	if (save_size > ram_size)
+		std::get<MBC3>(mapper).save_rtc(rtc);
 
-	std::string title;
+	bool same = std::equal(ram.begin(), ram.end(), saved_file.begin()) &&
+	            (save_size == ram_size || MBC3::same_rtc(rtc, saved_file.data() + ram_size));
 
-	for (int i = 0; i < 16; i++) {
-		char c = rom_data[0x134 + i];
+	// A failed write leaves the file behind saved_file, it is submitted again
+	if (same && !SaveWriter::get().take_failure(getSaveFilePath()))
+		return;
 
-		if ('A' > c || c > 'Z')
-			break;
+	saved_file.assign(ram.begin(), ram.end());
+	saved_file.insert(saved_file.end(), rtc, rtc + (save_size - ram_size));
+	SaveWriter::get().submit(getSaveFilePath(), saved_file);
+}
 
-		title += c;
-	}
+void Cartridge::poll_save()
+{
+	if (!save_size)
+		return;
 
-	while (!title.empty() && title.back() == ' ')
-		title.pop_back();
+	auto now = std::chrono::steady_clock::now();
+	if (now < next_save)
+		return;
 
-	return title;
+	next_save = now + save_interval;
+	save();
 }
 
-u8 Cartridge::getCartridgeType() const
-{
-	if (rom_size < 0x148)
-		return 0;
-	return rom_data[0x147];
-}
+void Cartridge::setSaveInterval(std::chrono::milliseconds interval) { save_interval = interval; }
 
-std::string Cartridge::getCartridgeTypeString() const
+const char *Cartridge::getSaveFilePath()
 {
-	return CARTRIDGE_TYPES[getCartridgeType()];
-}
+	if (save_file_path.empty())
+		save_file_path = saves_folder_path + '/' + rom->getFingerprint().hex() + ".sav";
 
-u8 Cartridge::getRomSize() const
-{
-	if (rom_size < 0x149)
-		return 0;
-	return rom_data[0x148];
+	return save_file_path.c_str();
 }
 
-u8 Cartridge::getRamSize() const
+void Cartridge::migrate_legacy_save()
 {
-	if (rom_size < 0x14A)
-		return 0;
-	return rom_data[0x149];
-}
+	std::error_code error;
+
+	if (std::filesystem::exists(getSaveFilePath(), error))
+		return;
+
+	// Saves used to be named after the MD5 of the whole ROM. It is only computed while such files
+	// are left, to rename the one of this ROM, and once per ROM: the ROMs without one are listed
+	auto is_legacy = [](const std::filesystem::directory_entry &entry) {
+		std::string name = entry.path().filename().string();
+		return name.size() == 32 &&
+		       std::all_of(name.begin(), name.end(), [](unsigned char c) { return isxdigit(c); });
+	};
+	std::filesystem::directory_iterator saves(saves_folder_path, error);
+	if (error || std::none_of(begin(saves), end(saves), is_legacy))
+		return;
+
+	std::string   checked_path = saves_folder_path + "/.legacy_checked";
+	std::string   fingerprint  = rom->getFingerprint().hex();
+	std::ifstream checked(checked_path);
+	for (std::string line; std::getline(checked, line);) {
+		if (line == fingerprint)
+			return;
+	}
 
-u8 Cartridge::getLicenseCode() const
-{
-	if (rom_size < 0x14C)
-		return 0;
-	return rom_data[0x14B];
-}
+	std::string legacy_path = saves_folder_path + '/' + md5_hex(rom_data, rom_size);
+	if (!std::filesystem::exists(legacy_path, error)) {
+		// Appends of a line are atomic, other processes may be listing their ROM
+		std::string line = fingerprint + '\n';
+		int         fd   = open(checked_path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (fd >= 0) {
+			if (write(fd, line.data(), line.size()) < 0)
+				std::cerr << "Could not write " << checked_path << ": " << strerror(errno)
+				          << std::endl;
+			close(fd);
+		}
+		return;
+	}
 
-u8 Cartridge::getHeaderChecksum() const
-{
-	if (rom_size < 0x14E)
-		return 0;
-	return rom_data[0x14D];
+	// Another process of the same ROM may have renamed it first
+	std::filesystem::rename(legacy_path, getSaveFilePath(), error);
+	if (error == std::errc::no_such_file_or_directory)
+		return;
+	if (error)
+		throw std::runtime_error(error.message());
+	std::cout << "Renamed " << legacy_path << " to " << getSaveFilePath() << std::endl;
 }
 
-u16 Cartridge::getGlobalChecksum() const
+const u8 *Cartridge::getRomData() const { return rom_data; }
+
+size_t    Cartridge::getRomDataSize() const { return rom_size; }
+
+size_t Cartridge::getRamDataSize() const
 {
-	if (rom_size < 0x150)
+	// MBC2 has its RAM built in, the header of those cartridges says there is none
+	if (std::holds_alternative<MBC2>(mapper))
+		return MBC2::RAM_SIZE;
+
+	switch (getRamSize()) {
+	case 0x02:
+		return 0x2000;
+	case 0x03:
+		return 0x8000;
+	case 0x04:
+		return 0x20000;
+	case 0x05:
+		return 0x10000;
+	default:
 		return 0;
-	return (rom_data[0x14E] << 8) | rom_data[0x14F];
+	}
 }
 
-u8       *Cartridge::getRomData() { return rom_data.data(); }
+const u8 *Cartridge::getRomBankData(u16 bank) const
+{
+	size_t offset = static_cast<size_t>(bank) * 0x4000;
 
-const u8 *Cartridge::getRomData() const { return rom_data.data(); }
+	if (offset + 0x4000 <= rom_size)
+		return rom_data + offset;
+	if (offset < rom_size)
+		return last_bank.data();
+	return nullptr;
+}
 
-size_t    Cartridge::getRomDataSize() const { return rom_size; }
+// What reads of unmapped cartridge memory return
+static const std::array<u8, 0x4000> OPEN_BUS = [] {
+	std::array<u8, 0x4000> page;
+	page.fill(0xff);
+	return page;
+}();
 
-size_t    Cartridge::getRamDataSize() const { return getRamSize() * 0x2000; }
+void Cartridge::update_banks()
+{
+	// Mappers only drive the address lines the chips have, bank numbers wrap around their size
+	size_t rom_banks = std::max<size_t>((rom_size + 0x3fff) / 0x4000, 1);
+	size_t ram_banks = ram_size / 0x2000;
+	int    ram_bank;
+
+	std::visit(
+	    [&](const auto &mbc) {
+		    rom_bank0 = mbc.romBank0() % rom_banks;
+		    rom_bank  = mbc.romBank() % rom_banks;
+		    ram_bank  = mbc.ramBank();
+	    },
+	    mapper);
+
+	rom_bank0_data = getRomBankData(rom_bank0);
+	rom_bank_data  = getRomBankData(rom_bank) ? getRomBankData(rom_bank) : OPEN_BUS.data();
+	ram_bank_read  = ram_bank == RAM_MAPPER ? nullptr : OPEN_BUS.data();
+	ram_bank_write = nullptr;
+
+	if (ram_bank >= 0 && ram_banks) {
+		ram_bank_write = ram.data() + ram_bank % ram_banks * 0x2000;
+		ram_bank_read  = ram_bank_write;
+	}
+}
 
-u8        Cartridge::read_byte(u16 address)
+u8 Cartridge::read_byte(u16 address)
 {
 	if (address <= 0x3fff) {
-		return rom_data[address];
-	} else if (address >= 0x4000 && address <= 0x7fff) {
-		size_t bank_offset = rom_bank * 0x4000;
-		if (bank_offset + (address - 0x4000) < rom_size) {
-			return rom_data[bank_offset + (address - 0x4000)];
-		}
+		size_t offset = rom_bank0 * 0x4000 + address;
+
+		if (offset < rom_size)
+			return rom_data[offset];
 		return 0xff;
+	} else if (address >= 0x4000 && address <= 0x7fff) {
+		return rom_bank_data[address - 0x4000];
 	} else if (address >= 0xa000 && address <= 0xbfff) {
-		if (ram_enabled) {
-			size_t ram_offset = ram_bank * 0x2000;
-			return ram[ram_offset + (address - 0xa000)];
-		}
-		return 0xff;
+		if (ram_bank_read)
+			return ram_bank_read[address - 0xa000];
+		return std::visit(
+		    [&](const auto &mbc) { return mbc.read_ram(ram.data(), ram_size, address); }, mapper);
 	}
 	return 0xff;
 }
 
 void Cartridge::write_byte(u16 address, u8 value)
 {
-	u8 mbc_type = getCartridgeType();
-
-	if (address <= 0x1fff) {
-		ram_enabled = (value & 0x0f) == 0x0a;
-	} else if (address >= 0x2000 && address <= 0x3fff) {
-		if (mbc_type >= 0x01 && mbc_type <= 0x03) {
-			u8 bank = value & 0x1f;
-			if (bank == 0)
-				bank = 1;
-			rom_bank = bank;
-		} else if (mbc_type >= 0x0f && mbc_type <= 0x13) {
-			u8 bank = value & 0x7f;
-			if (bank == 0)
-				bank = 1;
-			rom_bank = bank;
-		} else if (mbc_type >= 0x19 && mbc_type <= 0x1e) {
-			rom_bank = (rom_bank & 0x100) | value;
-			if (rom_bank == 0)
-				rom_bank = 1;
-		}
-	} else if (address >= 0x4000 && address <= 0x5fff) {
-		if (mbc_type >= 0x01 && mbc_type <= 0x03) {
-			if (banking_mode == 0) {
-				rom_bank = (rom_bank & 0x1f) | ((value & 0x03) << 5);
-			} else {
-				ram_bank = value & 0x03;
-			}
-		} else if (mbc_type >= 0x0f && mbc_type <= 0x13) {
-			ram_bank = value & 0x0f;
-		} else if (mbc_type >= 0x19 && mbc_type <= 0x1e) {
-			rom_bank = (rom_bank & 0xff) | ((value & 0x01) << 8);
-			if (rom_bank == 0)
-				rom_bank = 1;
-		}
-	} else if (address >= 0x6000 && address <= 0x7fff) {
-		if (mbc_type >= 0x01 && mbc_type <= 0x03) {
-			banking_mode = value & 0x01;
-		}
+	if (address <= 0x7fff) {
+		bool ram_was_enabled = ram_bank_read != OPEN_BUS.data();
+
+		std::visit([&](auto &mbc) { mbc.write_register(address, value); }, mapper);
+		update_banks();
+
+		// Games disable the RAM once they are done with it, a good time to save
+		if (ram_was_enabled && ram_bank_read == OPEN_BUS.data())
+			save();
 	} else if (address >= 0xa000 && address <= 0xbfff) {
-		if (ram_enabled) {
-			size_t ram_offset                    = ram_bank * 0x2000;
-			ram[ram_offset + (address - 0xa000)] = value;
-		}
+		if (ram_bank_write)
+			ram_bank_write[address - 0xa000] = value;
+		else if (!ram_bank_read)
+			std::visit(
+			    [&](auto &mbc) { mbc.write_ram(ram.data(), ram_size, address, value); }, mapper);
 	}
 }
@@ -0,0 +1,160 @@
+#include <GBMU/CartridgeHeader.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace GBMU;
+
+CartridgeHeader::CartridgeHeader(const u8 *rom, size_t rom_size)
+{
+	if (rom && rom_size > START)
+		std::memcpy(bytes, rom + START, std::min<size_t>(rom_size - START, SIZE));
+}
+
+CartridgeHeader CartridgeHeader::read(int fd)
+{
+	// Only the header is read, the rest of the ROM stays on disk
+	CartridgeHeader header;
+	size_t          done = 0;
+
+	while (done < SIZE) {
+		ssize_t count = pread(fd, header.bytes + done, SIZE - done, START + done);
+		if (count < 0 && errno == EINTR)
+			continue;
+		if (count < 0)
+			throw std::runtime_error(strerror(errno));
+		if (count == 0) // Files shorter than a header leave the rest zeroed
+			break;
+		done += count;
+	}
+
+	return header;
+}
+
+CartridgeHeader CartridgeHeader::read(const std::string &filename)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error(strerror(errno));
+	}
+
+	try {
+		CartridgeHeader header = read(fd);
+		close(fd);
+		return header;
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+}
+
+std::string CartridgeHeader::getTitle() const
+{
+	std::string title;
+
+	for (int i = 0; i < 16; i++) {
+		char c = at(0x134 + i);
+
+		if ('A' > c || c > 'Z')
+			break;
+
+		title += c;
+	}
+
+	while (!title.empty() && title.back() == ' ')
+		title.pop_back();
+
+	return title;
+}
+
+std::string CartridgeHeader::getCartridgeTypeString() const
+{
+	switch (getCartridgeType()) {
+	case 0x00:
+		return "ROM ONLY";
+	case 0x01:
+		return "MBC1";
+	case 0x02:
+		return "MBC1+RAM";
+	case 0x03:
+		return "MBC1+RAM+BATTERY";
+	case 0x05:
+		return "MBC2";
+	case 0x06:
+		return "MBC2+BATTERY";
+	case 0x08:
+		return "ROM+RAM";
+	case 0x09:
+		return "ROM+RAM+BATTERY";
+	case 0x0b:
+		return "MMM01";
+	case 0x0c:
+		return "MMM01+RAM";
+	case 0x0d:
+		return "MMM01+RAM+BATTERY";
+	case 0x0f:
+		return "MBC3+TIMER+BATTERY";
+	case 0x10:
+		return "MBC3+TIMER+RAM+BATTERY";
+	case 0x11:
+		return "MBC3";
+	case 0x12:
+		return "MBC3+RAM";
+	case 0x13:
+		return "MBC3+RAM+BATTERY";
+	case 0x19:
+		return "MBC5";
+	case 0x1a:
+		return "MBC5+RAM";
+	case 0x1b:
+		return "MBC5+RAM+BATTERY";
+	case 0x1c:
+		return "MBC5+RUMBLE";
+	case 0x1d:
+		return "MBC5+RUMBLE+RAM";
+	case 0x1e:
+		return "MBC5+RUMBLE+RAM+BATTERY";
+	case 0x20:
+		return "MBC6";
+	case 0x22:
+		return "MBC7+SENSOR+RUMBLE+RAM+BATTERY";
+	case 0xfc:
+		return "POCKET CAMERA";
+	case 0xfd:
+		return "BANDAI TAMA5";
+	case 0xfe:
+		return "HuC3";
+	case 0xff:
+		return "HuC1+RAM+BATTERY";
+	default:
+		return "UNKNOWN";
+	}
+}
+
+u8 CartridgeHeader::computeHeaderChecksum() const
+{
+	u8 checksum = 0;
+
+	for (u16 address = 0x134; address <= 0x14c; address++)
+		checksum = checksum - at(address) - 1;
+	return checksum;
+}
+
+bool CartridgeHeader::isHeaderChecksumValid() const
+{
+	return computeHeaderChecksum() == getHeaderChecksum();
+}
+
+u16 CartridgeHeader::computeGlobalChecksum(const u8 *rom, size_t rom_size)
+{
+	u16 checksum = 0;
+
+	for (size_t i = 0; i < rom_size; i++) {
+		if (i != 0x14e && i != 0x14f)
+			checksum += rom[i];
+	}
+	return checksum;
+}
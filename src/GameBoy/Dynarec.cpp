@@ -0,0 +1,1150 @@
+#include <GBMU/Dynarec.hpp>
+#include <GBMU/GameBoy.hpp>
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <unistd.h>
+
+using namespace GBMU;
+
+// x86-64 registers, only the ones without a REX prefix are used (al, cl and dl for bytes)
+enum : u8 { EAX, ECX, EDX, EBX, ESP, EBP, ESI, EDI };
+
+// Condition codes, JUMP for an unconditional jump
+enum : u8 { BELOW = 0x2, EQUAL = 0x4, NOT_EQUAL = 0x5, GREATER_EQUAL = 0xD, JUMP = 0x10 };
+
+// Opcodes of `op r/m32, r32`, and extensions of the 0x83/0x81 and 0xC1 groups
+enum : u8 { ADD = 0x01, OR = 0x09, AND = 0x21, SUB = 0x29, XOR = 0x31 };
+enum : u8 { EXT_ADD = 0, EXT_OR = 1, EXT_AND = 4, EXT_SUB = 5, EXT_XOR = 6 };
+enum : u8 { ROL = 0, SHL = 4, SHR = 5 };
+
+// Offsets in the HotState
+#define HOT(field) static_cast<int>(offsetof(HotState, field))
+#define REG(field) static_cast<int>(offsetof(HotState, registers) + offsetof(Registers, field))
+
+static constexpr int F           = REG(f);
+static constexpr int A           = REG(a);
+static constexpr int HL          = REG(hl);
+static constexpr int SP          = REG(sp);
+static constexpr int PC          = REG(pc);
+static constexpr int LAZY_OP     = HOT(lazy) + offsetof(LazyFlags, op);
+static constexpr int LAZY_LEFT   = HOT(lazy) + offsetof(LazyFlags, left);
+static constexpr int LAZY_RIGHT  = HOT(lazy) + offsetof(LazyFlags, right);
+static constexpr int LAZY_RESULT = HOT(lazy) + offsetof(LazyFlags, result);
+static constexpr int TICKS       = HOT(ticks);
+static constexpr int IF          = HOT(interrupt_flags);
+static constexpr int IE          = HOT(interrupt_enable);
+static constexpr int IME         = HOT(ime);
+static constexpr int EI_DELAY    = HOT(enable_interrupt_delay);
+static constexpr int HALTED      = HOT(halted);
+
+// Operands as numbered in opcodes: r8 (6 is [hl]), r16 and r16stk
+static constexpr int R8[8]       = {REG(b), REG(c), REG(d), REG(e), REG(h), REG(l), -1, REG(a)};
+static constexpr int R16[4]      = {REG(bc), REG(de), REG(hl), REG(sp)};
+static constexpr int R16STK[4]   = {REG(bc), REG(de), REG(hl), REG(af)};
+
+#undef HOT
+#undef REG
+
+static_assert(HALTED == EI_DELAY + 1, "halted and enable_interrupt_delay are checked as one word");
+
+Dynarec::Dynarec(CPU &_cpu, MMU &_mmu)
+{
+	int fd = memfd_create("gbmu-dynarec", MFD_CLOEXEC);
+	if (fd < 0)
+		throw std::runtime_error(strerror(errno));
+
+	void *writable = MAP_FAILED, *executable = MAP_FAILED;
+	if (ftruncate(fd, CODE_CAPACITY) == 0) {
+		writable   = mmap(nullptr, CODE_CAPACITY, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		executable = mmap(nullptr, CODE_CAPACITY, PROT_READ | PROT_EXEC, MAP_SHARED, fd, 0);
+	}
+	int error = errno;
+	close(fd);
+
+	if (writable == MAP_FAILED || executable == MAP_FAILED) {
+		if (writable != MAP_FAILED)
+			munmap(writable, CODE_CAPACITY);
+		if (executable != MAP_FAILED)
+			munmap(executable, CODE_CAPACITY);
+		throw std::runtime_error(strerror(error));
+	}
+
+	code_writable    = static_cast<u8 *>(writable);
+	code             = static_cast<u8 *>(executable);
+
+	const u8 *base   = reinterpret_cast<const u8 *>(&_cpu.hot);
+	auto      offset = [base](const void *field) {
+		return static_cast<int>(static_cast<const u8 *>(field) - base);
+	};
+
+	hot              = -offset(&_cpu);
+	cpu              = offset(&_cpu);
+	mmu              = offset(&_mmu);
+	caught_up        = offset(&_cpu.caught_up);
+	native_budget    = offset(&_cpu.native_budget);
+	deferred_cycles  = offset(&_cpu.deferred_cycles);
+	instruction_pc   = offset(&_cpu.instruction_pc);
+	read_pages       = offset(_mmu.read_pages.data());
+	write_pages      = offset(_mmu.write_pages.data());
+}
+
+Dynarec::~Dynarec()
+{
+	munmap(code, CODE_CAPACITY);
+	munmap(code_writable, CODE_CAPACITY);
+}
+
+u8   Dynarec::read_slow(MMU *mmu, u16 address) { return mmu->read_slow(address); }
+
+void Dynarec::write_slow(MMU *mmu, u16 address, u8 value) { mmu->write_slow(address, value); }
+
+void Dynarec::materialize_flags(CPU *cpu) { cpu->materialize_flags(); }
+
+void Dynarec::run_handler(CPU *cpu, const BlockCache::Instruction *instruction)
+{
+	cpu->instruction_pc = cpu->hot.registers.pc;
+	cpu->prefetch       = instruction->bytes;
+	cpu->imm8();
+	instruction->handler(*cpu);
+	cpu->prefetch = nullptr;
+}
+
+void Dynarec::byte(u8 value) { out.push_back(value); }
+
+void Dynarec::dword(u32 value)
+{
+	for (int i = 0; i < 4; i++)
+		byte(value >> (i * 8));
+}
+
+// ModR/M of [rbx + offset]
+void Dynarec::mem(u8 reg, int offset)
+{
+	if (offset >= -128 && offset <= 127) {
+		byte(0x43 | reg << 3);
+		byte(offset);
+	} else {
+		byte(0x83 | reg << 3);
+		dword(offset);
+	}
+}
+
+void Dynarec::load8(u8 reg, int offset)
+{
+	byte(0x0F);
+	byte(0xB6);
+	mem(reg, offset);
+}
+
+void Dynarec::load16(u8 reg, int offset)
+{
+	byte(0x0F);
+	byte(0xB7);
+	mem(reg, offset);
+}
+
+void Dynarec::load32(u8 reg, int offset)
+{
+	byte(0x8B);
+	mem(reg, offset);
+}
+
+void Dynarec::store8(int offset, u8 reg)
+{
+	byte(0x88);
+	mem(reg, offset);
+}
+
+void Dynarec::store16(int offset, u8 reg)
+{
+	byte(0x66);
+	byte(0x89);
+	mem(reg, offset);
+}
+
+void Dynarec::store32(int offset, u8 reg)
+{
+	byte(0x89);
+	mem(reg, offset);
+}
+
+void Dynarec::store8i(int offset, u8 value)
+{
+	byte(0xC6);
+	mem(0, offset);
+	byte(value);
+}
+
+void Dynarec::store16i(int offset, u16 value)
+{
+	byte(0x66);
+	byte(0xC7);
+	mem(0, offset);
+	byte(value);
+	byte(value >> 8);
+}
+
+void Dynarec::add16i(int offset, s8 value)
+{
+	byte(0x66);
+	byte(0x83);
+	mem(EXT_ADD, offset);
+	byte(value);
+}
+
+void Dynarec::add32i(int offset, int value)
+{
+	byte(0x81);
+	mem(EXT_ADD, offset);
+	dword(value);
+}
+
+void Dynarec::cmp8i(int offset, u8 value)
+{
+	byte(0x80);
+	mem(7, offset);
+	byte(value);
+}
+
+void Dynarec::alu(u8 opcode, u8 dst, u8 src)
+{
+	byte(opcode);
+	byte(0xC0 | src << 3 | dst);
+}
+
+void Dynarec::alui(u8 ext, u8 reg, int value)
+{
+	byte(0x81);
+	byte(0xC0 | ext << 3 | reg);
+	dword(value);
+}
+
+void Dynarec::shift(u8 ext, u8 reg, u8 count)
+{
+	byte(0xC1);
+	byte(0xC0 | ext << 3 | reg);
+	byte(count);
+}
+
+void Dynarec::movi(u8 reg, u32 value)
+{
+	byte(0xB8 | reg);
+	dword(value);
+}
+
+void Dynarec::mov(u8 dst, u8 src) { alu(0x89, dst, src); }
+
+void Dynarec::movzx8(u8 dst, u8 src)
+{
+	byte(0x0F);
+	byte(0xB6);
+	byte(0xC0 | dst << 3 | src);
+}
+
+// reg = ZF, the register must have been cleared before the flags were set
+void Dynarec::sete(u8 reg)
+{
+	byte(0x0F);
+	byte(0x94);
+	byte(0xC0 | reg);
+}
+
+// Spill slots at [rsp], preserved across helper calls
+void Dynarec::scratch_store(u8 reg, u8 slot)
+{
+	byte(0x89);
+	byte(0x44 | reg << 3);
+	byte(0x24);
+	byte(slot * 4);
+}
+
+void Dynarec::scratch_load(u8 reg, u8 slot)
+{
+	byte(0x8B);
+	byte(0x44 | reg << 3);
+	byte(0x24);
+	byte(slot * 4);
+}
+
+void Dynarec::lea_rdi(int offset)
+{
+	byte(0x48);
+	byte(0x8D);
+	byte(0xBB);
+	dword(offset);
+}
+
+void Dynarec::call(const void *function)
+{
+	u64 address = reinterpret_cast<u64>(function);
+
+	// mov rax, imm64; call rax
+	byte(0x48);
+	byte(0xB8);
+	dword(address);
+	dword(address >> 32);
+	byte(0xFF);
+	byte(0xD0);
+}
+
+size_t Dynarec::jump(u8 condition)
+{
+	if (condition == JUMP)
+		byte(0xE9);
+	else {
+		byte(0x0F);
+		byte(0x80 | condition);
+	}
+	dword(0);
+	return out.size();
+}
+
+void Dynarec::bind(size_t jump)
+{
+	u32 relative = out.size() - jump;
+	std::memcpy(&out[jump - 4], &relative, 4);
+}
+
+void Dynarec::exit_if(u8 condition) { exits.push_back(jump(condition)); }
+
+// Cycles are counted when the interpreter would count them, but only written to hot.ticks before
+// something could read them
+void Dynarec::tick(int cycles) { pending_ticks += cycles; }
+
+void Dynarec::flush_ticks()
+{
+	if (pending_ticks)
+		add32i(TICKS, pending_ticks);
+	pending_ticks = 0;
+}
+
+// eax = [ecx], through the memory map like CPU::read_byte. Helper calls clobber every register
+// but ebx
+void Dynarec::read()
+{
+	tick(TICKS_PER_CYCLES);
+	flush_ticks();
+	full_check = true;
+
+	// mov rax, [rbx + rax * 8 + read_pages]
+	mov(EAX, ECX);
+	shift(SHR, EAX, MMU::PAGE_SHIFT);
+	byte(0x48);
+	byte(0x8B);
+	byte(0x84);
+	byte(0xC3);
+	dword(read_pages);
+	// test rax, rax
+	byte(0x48);
+	byte(0x85);
+	byte(0xC0);
+	size_t slow = jump(EQUAL);
+
+	// movzx eax, byte [rax + rcx]
+	movzx8(ECX, ECX);
+	byte(0x0F);
+	byte(0xB6);
+	byte(0x04);
+	byte(0x08);
+	size_t done = jump(JUMP);
+
+	// Only the slow path reports watchpoints, and needs the start of the instruction
+	bind(slow);
+	store16i(instruction_pc, instruction_address);
+	lea_rdi(mmu);
+	mov(ESI, ECX);
+	call(reinterpret_cast<const void *>(&read_slow));
+	movzx8(EAX, EAX);
+	bind(done);
+}
+
+// [ecx] = dl, like CPU::write_byte
+void Dynarec::write()
+{
+	tick(TICKS_PER_CYCLES);
+	flush_ticks();
+	full_check = true;
+
+	// mov rax, [rbx + rax * 8 + write_pages]
+	mov(EAX, ECX);
+	shift(SHR, EAX, MMU::PAGE_SHIFT);
+	byte(0x48);
+	byte(0x8B);
+	byte(0x84);
+	byte(0xC3);
+	dword(write_pages);
+	// test rax, rax
+	byte(0x48);
+	byte(0x85);
+	byte(0xC0);
+	size_t slow = jump(EQUAL);
+
+	// mov [rax + rcx], dl
+	movzx8(ECX, ECX);
+	byte(0x88);
+	byte(0x14);
+	byte(0x08);
+	size_t done = jump(JUMP);
+
+	bind(slow);
+	store16i(instruction_pc, instruction_address);
+	lea_rdi(mmu);
+	mov(ESI, ECX);
+	movzx8(EDX, EDX);
+	call(reinterpret_cast<const void *>(&write_slow));
+	bind(done);
+}
+
+// Pushes dl
+void Dynarec::push()
+{
+	add16i(SP, -1);
+	load16(ECX, SP);
+	write();
+}
+
+// eax = popped byte
+void Dynarec::pop()
+{
+	load16(ECX, SP);
+	add16i(SP, 1);
+	read();
+}
+
+// eax = r8
+void Dynarec::read_r8(u8 code)
+{
+	if ((code & 7) == 6) {
+		load16(ECX, HL);
+		read();
+	} else
+		load8(EAX, R8[code & 7]);
+}
+
+// r8 = dl
+void Dynarec::write_r8(u8 code)
+{
+	if ((code & 7) == 6) {
+		load16(ECX, HL);
+		write();
+	} else
+		store8(R8[code & 7], EDX);
+}
+
+// edx = CPU::getCarryFlag() ? CARRY : 0, clobbers eax
+void Dynarec::carry()
+{
+	load8(EAX, LAZY_OP);
+	alu(0x85, EAX, EAX);
+	size_t lazy = jump(NOT_EQUAL);
+	load8(EDX, F);
+	size_t done = jump(JUMP);
+
+	bind(lazy);
+	alui(7, EAX, LAZY_INC);
+	size_t arithmetic = jump(BELOW);
+	load8(EDX, LAZY_LEFT);
+	size_t known = jump(JUMP);
+
+	// Bit 8 of the result
+	bind(arithmetic);
+	load16(EDX, LAZY_RESULT);
+	shift(SHR, EDX, 4);
+
+	bind(done);
+	bind(known);
+	alui(EXT_AND, EDX, CPU::CARRY);
+}
+
+// edx = CPU::getZeroFlag(), clobbers eax
+void Dynarec::zero()
+{
+	load8(EAX, LAZY_OP);
+	alu(0x85, EAX, EAX);
+	size_t lazy = jump(NOT_EQUAL);
+	load8(EDX, F);
+	shift(SHR, EDX, 7);
+	size_t done = jump(JUMP);
+
+	bind(lazy);
+	alu(XOR, EDX, EDX);
+	cmp8i(LAZY_RESULT, 0);
+	sete(EDX);
+
+	bind(done);
+}
+
+// edx = CPU::cond<code>(), non-zero when true
+void Dynarec::condition(u8 code)
+{
+	if ((code & 2) == 0) {
+		zero();
+		if ((code & 1) == 0)
+			alui(EXT_XOR, EDX, 1);
+	} else {
+		carry();
+		if ((code & 1) == 0)
+			alui(EXT_XOR, EDX, CPU::CARRY);
+	}
+}
+
+// CPU::flags()
+void Dynarec::materialize()
+{
+	cmp8i(LAZY_OP, LAZY_NONE);
+	size_t done = jump(EQUAL);
+	lea_rdi(cpu);
+	call(reinterpret_cast<const void *>(&materialize_flags));
+	bind(done);
+}
+
+// add, adc, sub, sbc, and, xor, or or cp on a and eax
+void Dynarec::arithmetic(u8 operation)
+{
+	if (operation == 1 || operation == 3) {
+		scratch_store(EAX, 0);
+		carry();
+		shift(SHR, EDX, 4);
+		scratch_load(EAX, 0);
+	}
+
+	load8(ECX, A);
+
+	switch (operation) {
+	case 0: // add
+	case 1: // adc
+		store8(LAZY_LEFT, ECX);
+		store8(LAZY_RIGHT, EAX);
+		alu(ADD, ECX, EAX);
+		if (operation == 1)
+			alu(ADD, ECX, EDX);
+		store16(LAZY_RESULT, ECX);
+		store8(A, ECX);
+		store8i(LAZY_OP, LAZY_ADD);
+		break;
+	case 2: // sub
+	case 3: // sbc
+	case 7: // cp
+		store8(LAZY_LEFT, ECX);
+		store8(LAZY_RIGHT, EAX);
+		alu(SUB, ECX, EAX);
+		if (operation == 3)
+			alu(SUB, ECX, EDX);
+		alui(EXT_AND, ECX, 0x1ff);
+		store16(LAZY_RESULT, ECX);
+		if (operation != 7)
+			store8(A, ECX);
+		store8i(LAZY_OP, LAZY_SUB);
+		break;
+	default: // and, xor, or
+		alu(operation == 4 ? AND : operation == 5 ? XOR : OR, ECX, EAX);
+		store8(A, ECX);
+		store16(LAZY_RESULT, ECX);
+		store8i(LAZY_LEFT, operation == 4 ? CPU::HALF_CARRY : 0);
+		store8i(LAZY_RIGHT, 0);
+		store8i(LAZY_OP, LAZY_LOGIC);
+		break;
+	}
+}
+
+// CPU::next_native(): leaves the block through the epilogue, or records the deferred cycles.
+// Only ticks can have changed after an instruction that neither accessed memory nor changed the
+// interrupt state
+void Dynarec::next_native()
+{
+	if (full_check) {
+		cmp8i(caught_up, 0);
+		exit_if(NOT_EQUAL);
+
+		// cmp word [rbx + EI_DELAY], 0, halted included
+		byte(0x66);
+		byte(0x83);
+		mem(7, EI_DELAY);
+		byte(0);
+		exit_if(NOT_EQUAL);
+
+		cmp8i(IME, 0);
+		size_t disabled = jump(EQUAL);
+		load8(EAX, IF);
+		// and al, [rbx + IE]
+		byte(0x22);
+		mem(EAX, IE);
+		exit_if(NOT_EQUAL);
+		bind(disabled);
+	}
+
+	// cmp eax, [rbx + native_budget]
+	load32(EAX, TICKS);
+	byte(0x3B);
+	mem(EAX, native_budget);
+	exit_if(GREATER_EQUAL);
+	store32(deferred_cycles, EAX);
+}
+
+bool Dynarec::inlined(const BlockCache::Instruction &instruction)
+{
+#if defined(GBMU_LOCKSTEP) || defined(GBMU_INSTRUMENT_MMU)
+	// Every fetch and access must go through the checks and counters of the interpreter
+	(void)instruction;
+	return false;
+#else
+	u8 opcode = instruction.bytes[0];
+
+	// Fused sequences
+	if (instruction.handler != CPU::OPCODES[opcode])
+		return false;
+
+	// stop, daa, add sp, imm8 and ld hl, sp + imm8 are rare, the others are not instructions
+	switch (opcode) {
+	case 0x10:
+	case 0x27:
+	case 0xE8:
+	case 0xF8:
+	case 0xD3:
+	case 0xDB:
+	case 0xDD:
+	case 0xE3:
+	case 0xE4:
+	case 0xEB:
+	case 0xEC:
+	case 0xED:
+	case 0xF4:
+	case 0xFC:
+	case 0xFD:
+		return false;
+	default:
+		return true;
+	}
+#endif
+}
+
+void Dynarec::fallback(const BlockCache::Instruction &instruction, u16 address)
+{
+	store16i(PC, address);
+	flush_ticks();
+	lea_rdi(cpu);
+	// mov rsi, imm64
+	u64 pointer = reinterpret_cast<u64>(&instruction);
+	byte(0x48);
+	byte(0xBE);
+	dword(pointer);
+	dword(pointer >> 32);
+	call(reinterpret_cast<const void *>(&run_handler));
+	full_check = true;
+}
+
+// Same cycles, memory accesses and state changes as CPU::execute<opcode>()
+void Dynarec::translate(const BlockCache::Instruction &instruction, u16 address)
+{
+	instruction_address = address;
+
+	if (!inlined(instruction)) {
+		fallback(instruction, address);
+		return;
+	}
+
+	const u8 *bytes  = instruction.bytes;
+	u8        opcode = bytes[0];
+	u16       end    = address + instruction.length;
+	u16       imm16  = bytes[1] | (bytes[2] << 8);
+
+	// Operands are always fetched before any access, the pc is already past them
+	store16i(PC, end);
+	tick(TICKS_PER_CYCLES);
+
+	// nop
+	if (opcode == 0x00) {
+	}
+
+	// ld r16, imm16
+	else if ((opcode & 0xCF) == 0x01) {
+		tick(TICKS_PER_CYCLES * 2);
+		store16i(R16[opcode >> 4], imm16);
+	}
+
+	// ld [r16mem], a and ld a, [r16mem]
+	else if ((opcode & 0xC7) == 0x02) {
+		u8 code = opcode >> 4;
+
+		load16(ECX, R16[code == 3 ? 2 : code]);
+		if (code >= 2)
+			add16i(HL, code == 2 ? 1 : -1);
+
+		if (opcode & 0x08) {
+			read();
+			store8(A, EAX);
+		} else {
+			load8(EDX, A);
+			write();
+		}
+	}
+
+	// ld [imm16], sp
+	else if (opcode == 0x08) {
+		tick(TICKS_PER_CYCLES * 2);
+		movi(ECX, imm16);
+		load8(EDX, SP);
+		write();
+		movi(ECX, static_cast<u16>(imm16 + 1));
+		load8(EDX, SP + 1);
+		write();
+	}
+
+	// inc r16 and dec r16
+	else if ((opcode & 0xC7) == 0x03) {
+		tick(TICKS_PER_CYCLES);
+		add16i(R16[opcode >> 4], opcode & 0x08 ? -1 : 1);
+	}
+
+	// add hl, r16
+	else if ((opcode & 0xCF) == 0x09) {
+		materialize();
+		load16(ECX, HL);
+		load16(EDX, R16[opcode >> 4]);
+
+		// Half carry from bit 11, carry from bit 15
+		mov(EAX, ECX);
+		alui(EXT_AND, EAX, 0xFFF);
+		mov(ESI, EDX);
+		alui(EXT_AND, ESI, 0xFFF);
+		alu(ADD, EAX, ESI);
+		shift(SHR, EAX, 7);
+		alui(EXT_AND, EAX, CPU::HALF_CARRY);
+		alu(ADD, ECX, EDX);
+		mov(ESI, ECX);
+		shift(SHR, ESI, 12);
+		alui(EXT_AND, ESI, CPU::CARRY);
+		alu(OR, EAX, ESI);
+
+		load8(EDX, F);
+		alui(EXT_AND, EDX, ~(CPU::NEGATIVE | CPU::HALF_CARRY | CPU::CARRY) & 0xFF);
+		alu(OR, EDX, EAX);
+		store8(F, EDX);
+
+		tick(TICKS_PER_CYCLES);
+		store16(HL, ECX);
+	}
+
+	// inc r8 and dec r8
+	else if ((opcode & 0xC6) == 0x04) {
+		u8 code = opcode >> 3;
+
+		read_r8(code);
+		alui(EXT_ADD, EAX, opcode & 1 ? -1 : 1);
+		movzx8(EAX, EAX);
+		scratch_store(EAX, 0);
+		mov(EDX, EAX);
+		write_r8(code);
+
+		carry();
+		store8(LAZY_LEFT, EDX);
+		store8i(LAZY_RIGHT, 0);
+		scratch_load(EAX, 0);
+		store16(LAZY_RESULT, EAX);
+		store8i(LAZY_OP, opcode & 1 ? LAZY_DEC : LAZY_INC);
+	}
+
+	// ld r8, imm8
+	else if ((opcode & 0xC7) == 0x06) {
+		tick(TICKS_PER_CYCLES);
+		movi(EDX, bytes[1]);
+		write_r8(opcode >> 3);
+	}
+
+	// rlca, rrca, rla and rra
+	else if ((opcode & 0xE7) == 0x07 && opcode < 0x20) {
+		if (opcode >= 0x17) {
+			carry();
+			shift(SHR, EDX, 4);
+		}
+		load8(EAX, A);
+
+		if (opcode == 0x07 || opcode == 0x17) {
+			mov(ECX, EAX);
+			shift(SHR, ECX, 7);
+			shift(SHL, EAX, 1);
+			alu(OR, EAX, opcode == 0x07 ? ECX : EDX);
+		} else {
+			mov(ECX, EAX);
+			alui(EXT_AND, ECX, 1);
+			shift(SHR, EAX, 1);
+			if (opcode == 0x0F)
+				mov(EDX, ECX);
+			shift(SHL, EDX, 7);
+			alu(OR, EAX, EDX);
+		}
+
+		store8(A, EAX);
+		shift(SHL, ECX, 4);
+		store8(F, ECX);
+		store8i(LAZY_OP, LAZY_NONE);
+	}
+
+	// cpl, scf and ccf
+	else if (opcode == 0x2F || opcode == 0x37 || opcode == 0x3F) {
+		materialize();
+		load8(EAX, F);
+
+		if (opcode == 0x2F) {
+			load8(ECX, A);
+			alui(EXT_XOR, ECX, 0xFF);
+			store8(A, ECX);
+			alui(EXT_OR, EAX, CPU::NEGATIVE | CPU::HALF_CARRY);
+		} else if (opcode == 0x37) {
+			alui(EXT_AND, EAX, ~(CPU::NEGATIVE | CPU::HALF_CARRY) & 0xFF);
+			alui(EXT_OR, EAX, CPU::CARRY);
+		} else {
+			alui(EXT_AND, EAX, ~(CPU::NEGATIVE | CPU::HALF_CARRY) & 0xFF);
+			alui(EXT_XOR, EAX, CPU::CARRY);
+		}
+
+		store8(F, EAX);
+	}
+
+	// jr imm8
+	else if (opcode == 0x18) {
+		tick(TICKS_PER_CYCLES * 2);
+		store16i(PC, end + static_cast<s8>(bytes[1]));
+	}
+
+	// jr cond, imm8 and jp cond, imm16
+	else if ((opcode & 0xE7) == 0x20 || (opcode & 0xE7) == 0xC2) {
+		tick(TICKS_PER_CYCLES * (opcode < 0x40 ? 1 : 2));
+		condition(opcode >> 3);
+		flush_ticks();
+
+		alu(0x85, EDX, EDX);
+		size_t skip = jump(EQUAL);
+		add32i(TICKS, TICKS_PER_CYCLES);
+		store16i(PC, opcode < 0x40 ? end + static_cast<s8>(bytes[1]) : imm16);
+		bind(skip);
+	}
+
+	// halt
+	else if (opcode == 0x76) {
+		store8i(HALTED, true);
+		full_check = true;
+	}
+
+	// ld r8, r8
+	else if ((opcode & 0xC0) == 0x40) {
+		read_r8(opcode);
+		mov(EDX, EAX);
+		write_r8(opcode >> 3);
+	}
+
+	// Arithmetic on a and r8
+	else if ((opcode & 0xC0) == 0x80) {
+		read_r8(opcode);
+		arithmetic((opcode >> 3) & 7);
+	}
+
+	// Arithmetic on a and imm8
+	else if ((opcode & 0xC7) == 0xC6) {
+		tick(TICKS_PER_CYCLES);
+		movi(EAX, bytes[1]);
+		arithmetic((opcode >> 3) & 7);
+	}
+
+	// ret cond, ret and reti
+	else if ((opcode & 0xE7) == 0xC0 || opcode == 0xC9 || opcode == 0xD9) {
+		size_t skip = 0;
+
+		if ((opcode & 0xE7) == 0xC0) {
+			tick(TICKS_PER_CYCLES);
+			condition(opcode >> 3);
+			flush_ticks();
+			alu(0x85, EDX, EDX);
+			skip = jump(EQUAL);
+		}
+
+		pop();
+		scratch_store(EAX, 0);
+		pop();
+		shift(SHL, EAX, 8);
+		scratch_load(ECX, 0);
+		alu(OR, EAX, ECX);
+		tick(TICKS_PER_CYCLES);
+		flush_ticks();
+		store16(PC, EAX);
+
+		if (opcode == 0xD9)
+			store8i(IME, 1);
+		if (skip)
+			bind(skip);
+	}
+
+	// jp imm16
+	else if (opcode == 0xC3) {
+		tick(TICKS_PER_CYCLES * 3);
+		store16i(PC, imm16);
+	}
+
+	// jp hl
+	else if (opcode == 0xE9) {
+		load16(EAX, HL);
+		store16(PC, EAX);
+	}
+
+	// call cond, imm16, call imm16 and rst tgt3
+	else if ((opcode & 0xE7) == 0xC4 || opcode == 0xCD || (opcode & 0xC7) == 0xC7) {
+		size_t skip = 0;
+
+		if ((opcode & 0xC7) != 0xC7)
+			tick(TICKS_PER_CYCLES * 2);
+
+		if ((opcode & 0xE7) == 0xC4) {
+			condition(opcode >> 3);
+			flush_ticks();
+			alu(0x85, EDX, EDX);
+			skip = jump(EQUAL);
+		}
+
+		movi(EDX, end >> 8);
+		push();
+		movi(EDX, end & 0xFF);
+		push();
+		tick(TICKS_PER_CYCLES);
+		flush_ticks();
+		store16i(PC, (opcode & 0xC7) == 0xC7 ? opcode & 0x38 : imm16);
+
+		if (skip)
+			bind(skip);
+	}
+
+	// pop r16stk
+	else if ((opcode & 0xCF) == 0xC1) {
+		pop();
+		scratch_store(EAX, 0);
+		pop();
+		shift(SHL, EAX, 8);
+		scratch_load(ECX, 0);
+		alu(OR, EAX, ECX);
+		store16(R16STK[(opcode >> 4) & 3], EAX);
+
+		// Lower 4 bits of F are always 0
+		if (opcode == 0xF1) {
+			load8(EAX, F);
+			alui(EXT_AND, EAX, 0xF0);
+			store8(F, EAX);
+			store8i(LAZY_OP, LAZY_NONE);
+		}
+	}
+
+	// push r16stk
+	else if ((opcode & 0xCF) == 0xC5) {
+		tick(TICKS_PER_CYCLES);
+		if (opcode == 0xF5)
+			materialize();
+
+		load16(EAX, R16STK[(opcode >> 4) & 3]);
+		scratch_store(EAX, 0);
+		mov(EDX, EAX);
+		shift(SHR, EDX, 8);
+		push();
+		scratch_load(EDX, 0);
+		push();
+	}
+
+	// prefix
+	else if (opcode == 0xCB) {
+		tick(TICKS_PER_CYCLES);
+		translate_cb(bytes[1]);
+	}
+
+	// ldh [c], a, ldh [imm8], a, ld [imm16], a and the loads the other way
+	else if ((opcode & 0xED) == 0xE0 || (opcode & 0xEF) == 0xEA) {
+		if (opcode == 0xE2 || opcode == 0xF2) {
+			load8(ECX, R8[1]);
+			alui(EXT_OR, ECX, 0xFF00);
+		} else if ((opcode & 0x0F) == 0x00) {
+			tick(TICKS_PER_CYCLES);
+			movi(ECX, 0xFF00 | bytes[1]);
+		} else {
+			tick(TICKS_PER_CYCLES * 2);
+			movi(ECX, imm16);
+		}
+
+		if (opcode & 0x10) {
+			read();
+			store8(A, EAX);
+		} else {
+			load8(EDX, A);
+			write();
+		}
+	}
+
+	// ld sp, hl
+	else if (opcode == 0xF9) {
+		tick(TICKS_PER_CYCLES);
+		load16(EAX, HL);
+		store16(SP, EAX);
+	}
+
+	// di and ei
+	else if (opcode == 0xF3)
+		store8i(IME, 0);
+	else if (opcode == 0xFB) {
+		store8i(EI_DELAY, true);
+		full_check = true;
+	}
+
+	else
+		throw std::logic_error("Dynarec: no translation for an inlined opcode");
+}
+
+// Same as CPU::execute_cb<opcode>(), the prefix was already counted
+void Dynarec::translate_cb(u8 opcode)
+{
+	u8 mask = 1 << ((opcode >> 3) & 7);
+
+	read_r8(opcode);
+
+	// rlc, rrc, rl, rr, sla, sra, swap and srl: result in eax, carry out (0 or 1) in ecx
+	if (opcode < 0x40) {
+		u8 operation = opcode >> 3;
+
+		if (operation == 2 || operation == 3) {
+			scratch_store(EAX, 0);
+			carry();
+			mov(ESI, EDX);
+			shift(SHR, ESI, 4);
+			scratch_load(EAX, 0);
+		}
+
+		switch (operation) {
+		case 0: // rlc
+		case 2: // rl
+		case 4: // sla
+			mov(ECX, EAX);
+			shift(SHR, ECX, 7);
+			shift(SHL, EAX, 1);
+			if (operation != 4)
+				alu(OR, EAX, operation == 0 ? ECX : ESI);
+			alui(EXT_AND, EAX, 0xFF);
+			break;
+		case 6: // swap
+			mov(EDX, EAX);
+			shift(SHL, EAX, 4);
+			shift(SHR, EDX, 4);
+			alu(OR, EAX, EDX);
+			alui(EXT_AND, EAX, 0xFF);
+			alu(XOR, ECX, ECX);
+			break;
+		default: // rrc, rr, sra and srl
+			mov(ECX, EAX);
+			alui(EXT_AND, ECX, 1);
+			mov(EDX, EAX);
+			shift(SHR, EAX, 1);
+			if (operation == 1) {
+				mov(EDX, ECX);
+				shift(SHL, EDX, 7);
+				alu(OR, EAX, EDX);
+			} else if (operation == 3) {
+				shift(SHL, ESI, 7);
+				alu(OR, EAX, ESI);
+			} else if (operation == 5) {
+				alui(EXT_AND, EDX, 0x80);
+				alu(OR, EAX, EDX);
+			}
+			break;
+		}
+
+		// New flags: Z from the result, C from the bit shifted out
+		shift(SHL, ECX, 4);
+		alu(XOR, EDX, EDX);
+		alu(0x85, EAX, EAX);
+		sete(EDX);
+		shift(SHL, EDX, 7);
+		alu(OR, ECX, EDX);
+		scratch_store(ECX, 1);
+
+		mov(EDX, EAX);
+		write_r8(opcode);
+
+		scratch_load(ECX, 1);
+		store8(F, ECX);
+		store8i(LAZY_OP, LAZY_NONE);
+	}
+
+	// bit b3, r8
+	else if (opcode < 0x80) {
+		alui(EXT_AND, EAX, mask);
+		scratch_store(EAX, 0);
+		carry();
+		alui(EXT_OR, EDX, CPU::HALF_CARRY);
+		scratch_load(EAX, 0);
+		alu(XOR, ECX, ECX);
+		alu(0x85, EAX, EAX);
+		sete(ECX);
+		shift(SHL, ECX, 7);
+		alu(OR, EDX, ECX);
+		store8(F, EDX);
+		store8i(LAZY_OP, LAZY_NONE);
+	}
+
+	// res b3, r8 and set b3, r8
+	else {
+		if (opcode < 0xC0)
+			alui(EXT_AND, EAX, ~mask & 0xFF);
+		else
+			alui(EXT_OR, EAX, mask);
+		mov(EDX, EAX);
+		write_r8(opcode);
+	}
+}
+
+Dynarec::Native Dynarec::compile(const BlockCache::Block &block)
+{
+	out.clear();
+	exits.clear();
+	pending_ticks = 0;
+
+	// push rbx; sub rsp, 16 (spill slots, keeps calls aligned); lea rbx, [rdi + hot]
+	byte(0x53);
+	byte(0x48);
+	byte(0x83);
+	byte(0xEC);
+	byte(0x10);
+	byte(0x48);
+	byte(0x8D);
+	byte(0x9F);
+	dword(hot);
+
+	u16 address = block.start;
+
+	for (size_t i = 0; i < block.instructions.size(); i++) {
+		const BlockCache::Instruction &instruction = block.instructions[i];
+
+		// An interrupt may be pending from the start of the step (ime just set by ei)
+		full_check = i == 0;
+		translate(instruction, address);
+		flush_ticks();
+
+		address += instruction.length;
+		if (i + 1 < block.instructions.size())
+			next_native();
+	}
+
+	// add rsp, 16; pop rbx; ret
+	for (size_t exit : exits)
+		bind(exit);
+	byte(0x48);
+	byte(0x83);
+	byte(0xC4);
+	byte(0x10);
+	byte(0x5B);
+	byte(0xC3);
+
+	if (code_size + out.size() > CODE_CAPACITY)
+		return nullptr;
+
+	std::memcpy(code_writable + code_size, out.data(), out.size());
+	Native native  = reinterpret_cast<Native>(code + code_size);
+	code_size     += (out.size() + 15) & ~15;
+
+	return native;
+}
@@ -0,0 +1,114 @@
+#include <GBMU/Fingerprint.hpp>
+#include <algorithm>
+#include <bit>
+#include <cstdio>
+#include <cstring>
+
+using namespace GBMU;
+
+static constexpr u64 PRIME1 = 0x9e3779b185ebca87;
+static constexpr u64 PRIME2 = 0xc2b2ae3d27d4eb4f;
+static constexpr u64 PRIME3 = 0x165667b19e3779f9;
+static constexpr u64 PRIME4 = 0x85ebca77c2b2ae63;
+
+static u64           read64(const u8 *data)
+{
+	u64 value;
+	std::memcpy(&value, data, sizeof(value));
+	return value;
+}
+
+static u64 mix_lane(u64 lane, u64 input) { return std::rotl(lane + input * PRIME2, 31) * PRIME1; }
+
+static u64 avalanche(u64 value)
+{
+	value ^= value >> 33;
+	value *= PRIME2;
+	value ^= value >> 29;
+	value *= PRIME3;
+	value ^= value >> 32;
+	return value;
+}
+
+std::string Fingerprint::hex() const
+{
+	char text[33];
+
+	snprintf(text, sizeof(text), "%016llx%016llx", (unsigned long long)high,
+	         (unsigned long long)low);
+	return text;
+}
+
+bool Fingerprint::parse(const std::string &hex, Fingerprint &fingerprint)
+{
+	unsigned long long high, low;
+	int                length;
+
+	if (hex.size() != 32 || sscanf(hex.c_str(), "%16llx%16llx%n", &high, &low, &length) != 2 ||
+	    length != 32)
+		return false;
+
+	fingerprint.high = high;
+	fingerprint.low  = low;
+	return true;
+}
+
+FingerprintHasher::FingerprintHasher() : lanes{PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1} {}
+
+void FingerprintHasher::consume(const u8 *stripe)
+{
+	for (int i = 0; i < 4; i++)
+		lanes[i] = mix_lane(lanes[i], read64(stripe + i * 8));
+}
+
+void FingerprintHasher::update(const u8 *data, size_t size)
+{
+	total += size;
+
+	if (buffered) {
+		size_t missing = std::min(sizeof(buffer) - buffered, size);
+
+		std::memcpy(buffer + buffered, data, missing);
+		buffered += missing;
+		data     += missing;
+		size     -= missing;
+
+		if (buffered < sizeof(buffer))
+			return;
+		consume(buffer);
+		buffered = 0;
+	}
+
+	for (; size >= sizeof(buffer); data += sizeof(buffer), size -= sizeof(buffer))
+		consume(data);
+
+	std::memcpy(buffer, data, size);
+	buffered = size;
+}
+
+Fingerprint FingerprintHasher::finish() const
+{
+	u64 last[4] = {lanes[0], lanes[1], lanes[2], lanes[3]};
+
+	// The incomplete stripe, zero padded, the total length tells it apart from real zeros
+	if (buffered) {
+		u8 stripe[32] = {};
+		std::memcpy(stripe, buffer, buffered);
+		for (int i = 0; i < 4; i++)
+			last[i] = mix_lane(last[i], read64(stripe + i * 8));
+	}
+
+	u64 low  = std::rotl(last[0], 1) + std::rotl(last[1], 7) + std::rotl(last[2], 12) +
+	           std::rotl(last[3], 18);
+	u64 high = (last[0] ^ std::rotl(last[2], 29)) * PRIME4 + (last[1] ^ std::rotl(last[3], 41));
+
+	return {avalanche(low ^ total * PRIME3), avalanche(high + total * PRIME1 + low)};
+}
+
+Fingerprint FingerprintHasher::hash(const u8 *data, size_t size)
+{
+	FingerprintHasher hasher;
+
+	hasher.update(data, size);
+	return hasher.finish();
+}
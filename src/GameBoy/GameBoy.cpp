@@ -2,6 +2,7 @@
 #include <SDL2/SDL.h>
 #include <SDL2/SDL_events.h>
 #include <SDL2/SDL_scancode.h>
+#include <algorithm>
 #include <chrono>
 #include <iomanip>
 #include <iostream>
@@ -10,9 +11,9 @@
 
 using namespace GBMU;
 
-GameBoy::GameBoy(const std::string &filename)
-    : cartridge(filename), mmu(*this), apu(*this), ppu(*this), cpu(*this), serial(*this),
-      timer(*this), joypad(*this)
+GameBoy::GameBoy(const std::string &filename, const std::string &patch_filename)
+    : cartridge(filename, patch_filename), mmu(*this), apu(*this), ppu(*this), cpu(*this),
+      serial(*this), timer(*this), joypad(*this)
 {
 	std::cerr << "\033[1;33m" << cartridge.getTitle() << "\033[0m" << std::endl
 	          << "  Type: " << cartridge.getCartridgeTypeString() << std::endl
@@ -118,13 +119,46 @@ void GameBoy::pollEvents()
 
 void        GameBoy::stop() { running = false; }
 
-inline void GameBoy::compute_frame()
+void        GameBoy::compute_frame()
 {
-	for (int i = 0; i < 70224; i++) {
-		cpu.tick();
-		ppu.tick();
-		timer.tick();
+	for (u64 frame = frames; frames == frame;)
+		step();
+}
+
+int GameBoy::step()
+{
+	int cycles = cpu.step();
+
+	advance(cycles);
+	hot.ticks = 0;
+
+	if (hot.frame_cycles >= CYCLES_PER_FRAME) {
+		hot.frame_cycles -= CYCLES_PER_FRAME;
+		frames++;
+
+		cartridge.poll_save();
 	}
+
+	return cycles;
+}
+
+void GameBoy::advance(int cycles)
+{
+	ppu.tick(cycles);
+	timer.tick(cycles);
+
+	hot.frame_cycles += cycles;
+}
+
+int GameBoy::cyclesUntilNextEvent()
+{
+	return std::min({ppu.cyclesUntilNextEvent(), timer.cyclesUntilOverflow(),
+	                 CYCLES_PER_FRAME - hot.frame_cycles});
+}
+
+u64 GameBoy::elapsedCycles() const
+{
+	return frames * CYCLES_PER_FRAME + hot.frame_cycles + hot.ticks;
 }
 
 void GameBoy::run()
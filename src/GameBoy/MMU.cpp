@@ -3,72 +3,375 @@
 #include <bios.h>
 #include <iomanip>
 #include <iostream>
+#include <stdexcept>
+
+#ifdef GBMU_INSTRUMENT_MMU
+# include <algorithm>
+# include <fstream>
+# include <numeric>
+# include <sstream>
+# include <string>
+#endif
 
 using namespace GBMU;
 
-MMU::MMU(GameBoy &_gb) : gb(_gb)
+static void print_watchpoint_hit(const MMU::WatchpointHit &hit)
+{
+	const char *access = "Execute";
+
+	if (hit.kind == MMU::WATCH_READ)
+		access = "Read";
+	else if (hit.kind == MMU::WATCH_WRITE)
+		access = "Write";
+
+	std::cerr << access << " watchpoint at 0x" << std::hex << std::setw(4) << std::setfill('0')
+	          << hit.address << ": value 0x" << std::setw(2) << (int)hit.value << ", pc 0x"
+	          << std::setw(4) << hit.pc << std::dec << ", cycle " << hit.cycle << std::endl;
+}
+
+MMU::MMU(GameBoy &_gb)
+    : gb(_gb), watchpoint_callback(print_watchpoint_hit), wram(_gb.getArena().at(0xc000)),
+      hram(_gb.getArena().at(0xff80))
 {
-	read_handlers.fill(nullptr);
-	write_handlers.fill(nullptr);
+	handlers.push_back({nullptr, nullptr});
 
 	register_handler_range(
 	    0x0000, 0x7fff, [this](u16 addr) { return gb.getCartridge().read_byte(addr); },
-	    [this](u16 addr, u8 value) { gb.getCartridge().write_byte(addr, value); });
+	    [this](u16 addr, u8 value) {
+		    gb.getCartridge().write_byte(addr, value);
+		    map_cartridge();
+	    });
 	register_handler_range(
 	    0xa000, 0xbfff, [this](u16 addr) { return gb.getCartridge().read_byte(addr); },
 	    [this](u16 addr, u8 value) { gb.getCartridge().write_byte(addr, value); });
-	register_handler_range(
-	    0xc000, 0xcfff, [this](u16 addr) { return wram[addr - 0xc000]; },
-	    [this](u16 addr, u8 value) { wram[addr - 0xc000] = value; });
-	register_handler_range(
-	    0xd000, 0xdfff, [this](u16 addr) { return wram[addr - 0xc000]; },
-	    [this](u16 addr, u8 value) { wram[addr - 0xc000] = value; });
-	register_handler_range(
-	    0xe000, 0xefff, [this](u16 addr) { return wram[addr - 0xe000]; },
-	    [this](u16 addr, u8 value) { wram[addr - 0xe000] = value; });
-	register_handler_range(
-	    0xf000, 0xfdff, [this](u16 addr) { return wram[addr - 0xe000]; },
-	    [this](u16 addr, u8 value) { wram[addr - 0xe000] = value; });
 	register_handler(
 	    0xff50, [this](u16) { return bios_disabled; },
-	    [this](u16, u8 value) { bios_disabled = value; });
+	    [this](u16, u8 value) {
+		    bios_disabled = value;
+		    map_cartridge();
+	    });
 	register_handler_range(
 	    0xff80, 0xfffe, [this](u16 addr) { return hram[addr - 0xff80]; },
 	    [this](u16 addr, u8 value) { hram[addr - 0xff80] = value; });
 
+	map_memory(0xc000, 0xdfff, wram, wram);
+	map_memory(0xe000, 0xfdff, wram, wram);
+
 	bios_disabled = 0x01;
+	map_cartridge();
+
+#ifdef GBMU_INSTRUMENT_MMU
+	bank_reads.resize(std::max<size_t>(gb.getCartridge().getRomDataSize() / 0x4000, 2));
+#endif
+}
+
+MMU::~MMU()
+{
+#ifdef GBMU_INSTRUMENT_MMU
+	dump_heatmap();
+#endif
 }
 
-MMU::~MMU() {}
+u8 MMU::handlerAt(u16 address) const
+{
+	u8 handler = page_handlers[address >> PAGE_SHIFT];
+
+	if (handler & SPLIT_PAGE)
+		return split_pages[handler & ~SPLIT_PAGE][address & PAGE_MASK];
+	return handler;
+}
 
-u8 MMU::read_byte(u16 address)
+u8 MMU::read_unwatched(u16 address)
 {
-	if (address < 0x100 && bios_disabled == 0)
-		return dmg_bios[address];
+	if (const u8 *memory = mapped_reads[address >> PAGE_SHIFT])
+		return memory[address & PAGE_MASK];
 
-	if (read_handlers[address])
-		return read_handlers[address](address);
+	if (u8 handler = handlerAt(address); handler && handlers[handler].read)
+		return handlers[handler].read(address);
 
 	return 0xff;
 }
 
-void MMU::write_byte(u16 address, u8 value)
+u8 MMU::read_slow(u16 address)
+{
+	// HRAM only shares its page with the I/O registers, it never needs the PPU or Timer up to date
+	if (address < 0xff80 || address == 0xffff)
+		gb.getCPU().catch_up();
+
+	u8 value = read_unwatched(address);
+
+	if (watched_pages[address >> PAGE_SHIFT] & WATCH_READ)
+		report_watchpoints(address, value, WATCH_READ);
+
+	return value;
+}
+
+void MMU::write_slow(u16 address, u8 value)
+{
+	if (address < 0xff80 || address == 0xffff)
+		gb.getCPU().catch_up();
+
+	if (u8 *memory = mapped_writes[address >> PAGE_SHIFT])
+		memory[address & PAGE_MASK] = value;
+	else if (u8 handler = handlerAt(address); handler && handlers[handler].write)
+		handlers[handler].write(address, value);
+
+	if (watched_pages[address >> PAGE_SHIFT] & WATCH_WRITE)
+		report_watchpoints(address, value, WATCH_WRITE);
+}
+
+void MMU::update_page(int page)
+{
+	read_pages[page]  = watched_pages[page] & WATCH_READ ? nullptr : mapped_reads[page];
+	write_pages[page] = watched_pages[page] & WATCH_WRITE ? nullptr : mapped_writes[page];
+}
+
+void MMU::map_memory(u16 start, u16 end, const u8 *read, u8 *write)
+{
+	for (int page = start >> PAGE_SHIFT; page <= end >> PAGE_SHIFT; page++) {
+		size_t offset       = (page << PAGE_SHIFT) - start;
+
+		mapped_reads[page]  = read ? read + offset : nullptr;
+		mapped_writes[page] = write ? write + offset : nullptr;
+		update_page(page);
+	}
+}
+
+void MMU::map_cartridge()
 {
-	if (write_handlers[address])
-		write_handlers[address](address, value);
+	Cartridge &cartridge = gb.getCartridge();
+	const u8  *bank0     = cartridge.getSelectedRomBank0();
+	const u8  *bank      = cartridge.getSelectedRomBank();
+	const u8  *ram       = cartridge.getSelectedRamBank();
+	u8        *ram_write = cartridge.getWritableRamBank();
+
+	// Bank switches are the only writes that get here, most of them select the bank already mapped
+	map_memory(0x0000, 0x00ff, bios_disabled ? bank0 : dmg_bios, nullptr);
+	if (mapped_reads[0x01] != (bank0 ? bank0 + 0x100 : nullptr))
+		map_memory(0x0100, 0x3fff, bank0 ? bank0 + 0x100 : nullptr, nullptr);
+	if (mapped_reads[0x40] != bank)
+		map_memory(0x4000, 0x7fff, bank, nullptr);
+	if (mapped_reads[0xa0] != ram || mapped_writes[0xa0] != ram_write)
+		map_memory(0xa000, 0xbfff, ram, ram_write);
 }
 
 void MMU::register_handler(u16 address, ReadHandler read_handler, WriteHandler write_handler)
 {
-	read_handlers[address]  = read_handler;
-	write_handlers[address] = write_handler;
+	register_handler_range(address, address, read_handler, write_handler);
 }
 
 void MMU::register_handler_range(u16 start, u16 end, ReadHandler read_handler,
                                  WriteHandler write_handler)
 {
-	for (u16 addr = start; addr <= end; addr++) {
-		read_handlers[addr]  = read_handler;
-		write_handlers[addr] = write_handler;
+	if (handlers.size() >= SPLIT_PAGE)
+		throw std::runtime_error("Too many memory handlers");
+
+	u8 handler = handlers.size();
+	handlers.push_back({read_handler, write_handler});
+
+	for (u32 address = start; address <= end;) {
+		int page            = address >> PAGE_SHIFT;
+		mapped_reads[page]  = nullptr;
+		mapped_writes[page] = nullptr;
+		update_page(page);
+
+		// Whole pages only need their handler, the others are split in bytes
+		if ((address & PAGE_MASK) == 0 && address + PAGE_MASK <= end) {
+			page_handlers[page] = handler;
+			address            += PAGE_SIZE;
+			continue;
+		}
+
+		if (!(page_handlers[page] & SPLIT_PAGE)) {
+			if (split_pages.size() >= SPLIT_PAGE)
+				throw std::runtime_error("Too many split memory pages");
+
+			split_pages.emplace_back();
+			split_pages.back().fill(page_handlers[page]);
+			page_handlers[page] = SPLIT_PAGE | (split_pages.size() - 1);
+		}
+
+		split_pages[page_handlers[page] & ~SPLIT_PAGE][address & PAGE_MASK] = handler;
+		address++;
 	}
 }
+
+void MMU::add_watchpoint(u16 start, u16 end, u8 kinds)
+{
+	watchpoints.push_back({start, end, kinds});
+	update_watched_pages();
+}
+
+void MMU::remove_watchpoint(u16 start, u16 end)
+{
+	std::erase_if(watchpoints, [start, end](const Watchpoint &watchpoint) {
+		return watchpoint.start == start && watchpoint.end == end;
+	});
+	update_watched_pages();
+}
+
+void MMU::clear_watchpoints()
+{
+	watchpoints.clear();
+	update_watched_pages();
+}
+
+void MMU::set_watchpoint_callback(WatchpointCallback callback) { watchpoint_callback = callback; }
+
+void MMU::update_watched_pages()
+{
+	watched_pages.fill(0);
+	for (const Watchpoint &watchpoint : watchpoints)
+		for (int page = watchpoint.start >> PAGE_SHIFT; page <= watchpoint.end >> PAGE_SHIFT;
+		     page++)
+			watched_pages[page] |= watchpoint.kinds;
+
+	for (int page = 0; page < PAGE_COUNT; page++)
+		update_page(page);
+
+	// Other watchpoints only take their pages off the fast path. Those that shortcuts would miss
+	// make the CPU run one instruction at a time: execution, which native blocks don't check,
+	// reads of ROM, whose predecoded operands skip the MMU, and reads of the registers skipped
+	// idle loops poll
+	bool single_step = false;
+	for (const Watchpoint &watchpoint : watchpoints) {
+		auto covers = [&](u16 address) {
+			return watchpoint.start <= address && address <= watchpoint.end;
+		};
+
+		if (watchpoint.kinds & WATCH_EXECUTE)
+			single_step = true;
+		if (watchpoint.kinds & WATCH_READ &&
+		    (watchpoint.start <= 0x7fff || covers(0xff04) || covers(0xff41) || covers(0xff44)))
+			single_step = true;
+	}
+	gb.getHotState().watching = single_step;
+}
+
+void MMU::check_execute(u16 address)
+{
+	if (watched_pages[address >> PAGE_SHIFT] & WATCH_EXECUTE)
+		report_watchpoints(address, read_unwatched(address), WATCH_EXECUTE);
+}
+
+void MMU::report_watchpoints(u16 address, u8 value, u8 kind)
+{
+	for (const Watchpoint &watchpoint : watchpoints) {
+		if (!(watchpoint.kinds & kind) || address < watchpoint.start || address > watchpoint.end)
+			continue;
+
+		if (watchpoint_callback)
+			watchpoint_callback({address, gb.getCPU().getInstructionPC(), value,
+			                     gb.elapsedCycles(), kind});
+
+		// One report per access, even with overlapping watchpoints
+		break;
+	}
+}
+
+#ifdef GBMU_INSTRUMENT_MMU
+void MMU::count_read(u16 address)
+{
+	line_reads[address >> 4]++;
+
+	if (address >= 0xff00)
+		io_reads[address & 0xff]++;
+	else if (address >= 0x4000 && address <= 0x7fff &&
+	         gb.getCartridge().getRomBank() < bank_reads.size())
+		bank_reads[gb.getCartridge().getRomBank()]++;
+}
+
+void MMU::count_write(u16 address)
+{
+	line_writes[address >> 4]++;
+
+	if (address >= 0xff00)
+		io_writes[address & 0xff]++;
+}
+
+void MMU::dump_heatmap()
+{
+	// Binary dump: magic, bank count, then every counter as a native u64
+	std::ofstream out("mmu_heatmap.bin", std::ios::binary);
+	u64           bank_count = bank_reads.size();
+
+	out.write("GBMUHEAT", 8);
+	out.write(reinterpret_cast<const char *>(&bank_count), sizeof(bank_count));
+	out.write(reinterpret_cast<const char *>(line_reads.data()), sizeof(line_reads));
+	out.write(reinterpret_cast<const char *>(line_writes.data()), sizeof(line_writes));
+	out.write(reinterpret_cast<const char *>(io_reads.data()), sizeof(io_reads));
+	out.write(reinterpret_cast<const char *>(io_writes.data()), sizeof(io_writes));
+	out.write(reinterpret_cast<const char *>(bank_reads.data()), bank_count * sizeof(u64));
+
+	struct Region {
+		const char *name;
+		u16         start;
+		u16         end;
+	};
+
+	static const Region REGIONS[] = {
+	    {"ROM0", 0x0000, 0x3fff},
+	    {"ROMX", 0x4000, 0x7fff},
+	    {"VRAM", 0x8000, 0x9fff},
+	    {"ERAM", 0xa000, 0xbfff},
+	    {"WRAM", 0xc000, 0xdfff},
+	    {"Echo", 0xe000, 0xfdff},
+	    {"OAM", 0xfe00, 0xfeff},
+	    {"IO", 0xff00, 0xff7f},
+	    {"HRAM", 0xff80, 0xfffe},
+	    {"IE", 0xffff, 0xffff},
+	};
+
+	auto row = [](const std::string &name, u64 reads, u64 writes) {
+		std::cerr << "  " << std::setfill(' ') << std::left << std::setw(8) << name << std::right
+		          << std::setw(14) << reads << std::setw(14) << writes << std::endl;
+	};
+
+	std::cerr << "Memory accesses for " << gb.getCartridge().getTitle()
+	          << ", written to mmu_heatmap.bin" << std::endl;
+	std::cerr << " Regions:" << std::endl;
+	for (const Region &region : REGIONS) {
+		u64 reads  = 0;
+		u64 writes = 0;
+
+		// The high page is shared by I/O and HRAM, it is counted by address instead of by line
+		for (u32 address = region.start; address <= region.end; address++) {
+			if (address >= 0xff00) {
+				reads  += io_reads[address & 0xff];
+				writes += io_writes[address & 0xff];
+			} else if ((address & 0xf) == 0) {
+				reads  += line_reads[address >> 4];
+				writes += line_writes[address >> 4];
+			}
+		}
+
+		row(region.name, reads, writes);
+	}
+
+	std::cerr << " ROM banks:" << std::endl;
+	for (size_t bank = 1; bank < bank_reads.size(); bank++)
+		if (bank_reads[bank])
+			row(std::to_string(bank), bank_reads[bank], 0);
+
+	auto top = [&row](const u64 *reads, const u64 *writes, size_t size, u16 base, int shift) {
+		std::vector<size_t> sorted(size);
+		size_t              count = std::min<size_t>(size, 20);
+		auto                hits  = [&](size_t i) { return reads[i] + writes[i]; };
+
+		std::iota(sorted.begin(), sorted.end(), 0);
+		std::partial_sort(sorted.begin(), sorted.begin() + count, sorted.end(),
+		                  [&](size_t a, size_t b) { return hits(a) > hits(b); });
+
+		for (size_t i = 0; i < count && hits(sorted[i]); i++) {
+			std::stringstream ss;
+			ss << std::hex << std::setw(4) << std::setfill('0') << base + (sorted[i] << shift);
+			row(ss.str(), reads[sorted[i]], writes[sorted[i]]);
+		}
+	};
+
+	std::cerr << " Lines:" << std::endl;
+	top(line_reads.data(), line_writes.data(), line_reads.size(), 0x0000, 4);
+	std::cerr << " I/O registers and HRAM:" << std::endl;
+	top(io_reads.data(), io_writes.data(), io_reads.size(), 0xff00, 0);
+}
+#endif
@@ -0,0 +1,242 @@
+#include <GBMU/Mappers.hpp>
+#include <algorithm>
+
+using namespace GBMU;
+
+static constexpr u64 SECONDS_PER_DAY = 24 * 60 * 60;
+
+Mapper GBMU::select_mapper(u8 cartridge_type)
+{
+	switch (cartridge_type) {
+	case 0x01:
+	case 0x02:
+	case 0x03:
+		return MBC1{};
+	case 0x05:
+	case 0x06:
+		return MBC2{};
+	case 0x0f:
+	case 0x10: {
+		MBC3 mbc3;
+		mbc3.rtc = true;
+		return mbc3;
+	}
+	case 0x11:
+	case 0x12:
+	case 0x13:
+		return MBC3{};
+	case 0x19:
+	case 0x1a:
+	case 0x1b:
+	case 0x1c:
+	case 0x1d:
+	case 0x1e:
+		return MBC5{};
+	default:
+		return RomOnly{};
+	}
+}
+
+void MBC1::write_register(u16 address, u8 value)
+{
+	if (address <= 0x1fff) {
+		ram_enabled = (value & 0x0f) == 0x0a;
+	} else if (address <= 0x3fff) {
+		bank1 = value & 0x1f;
+		if (bank1 == 0)
+			bank1 = 1;
+	} else if (address <= 0x5fff) {
+		bank2 = value & 0x03;
+	} else {
+		mode = value & 0x01;
+	}
+}
+
+void MBC2::write_register(u16 address, u8 value)
+{
+	// Bit 8 of the address tells the two registers apart, everything above 0x3fff is ignored
+	if (address > 0x3fff)
+		return;
+
+	if (address & 0x100) {
+		rom_bank = value & 0x0f;
+		if (rom_bank == 0)
+			rom_bank = 1;
+	} else {
+		ram_enabled = (value & 0x0f) == 0x0a;
+	}
+}
+
+u8 MBC2::read_ram(const u8 *ram, size_t ram_size, u16 address) const
+{
+	if (!ram || ram_size < RAM_SIZE)
+		return 0xff;
+	return ram[address & (RAM_SIZE - 1)] | 0xf0;
+}
+
+void MBC2::write_ram(u8 *ram, size_t ram_size, u16 address, u8 value)
+{
+	if (ram && ram_size >= RAM_SIZE)
+		ram[address & (RAM_SIZE - 1)] = value & 0x0f;
+}
+
+void MBC3::write_register(u16 address, u8 value)
+{
+	if (address <= 0x1fff) {
+		ram_enabled = (value & 0x0f) == 0x0a;
+	} else if (address <= 0x3fff) {
+		rom_bank = value & 0x7f;
+		if (rom_bank == 0)
+			rom_bank = 1;
+	} else if (address <= 0x5fff) {
+		ram_bank = value & 0x0f;
+	} else {
+		if (latch == 0x00 && value == 0x01)
+			read_rtc(latched);
+		latch = value;
+	}
+}
+
+int MBC3::ramBank() const
+{
+	if (!ram_enabled)
+		return RAM_DISABLED;
+	if (ram_bank <= 0x03)
+		return ram_bank;
+	if (ram_bank >= 0x08 && ram_bank <= 0x0c)
+		return RAM_MAPPER;
+	return RAM_DISABLED;
+}
+
+void MBC3::sync_rtc()
+{
+	time_t now = time(nullptr);
+
+	if (rtc_halted)
+		return;
+
+	if (now > rtc_sync)
+		rtc_seconds += now - rtc_sync;
+	rtc_sync = now;
+
+	if (rtc_seconds >= 512 * SECONDS_PER_DAY) {
+		rtc_carry    = true;
+		rtc_seconds %= 512 * SECONDS_PER_DAY;
+	}
+}
+
+void MBC3::read_rtc(u8 registers[5])
+{
+	sync_rtc();
+	to_registers(rtc_seconds, rtc_halted << 6 | rtc_carry << 7, registers);
+}
+
+void MBC3::to_registers(u64 seconds, u8 flags, u8 registers[5])
+{
+	u64 days          = seconds / SECONDS_PER_DAY;
+
+	registers[RTC_S]  = seconds % 60;
+	registers[RTC_M]  = seconds / 60 % 60;
+	registers[RTC_H]  = seconds / 3600 % 24;
+	registers[RTC_DL] = days & 0xff;
+	registers[RTC_DH] = (days >> 8 & 0x01) | flags;
+}
+
+u8 MBC3::read_ram(const u8 *, size_t, u16) const
+{
+	if (ram_bank >= 0x08 && ram_bank <= 0x0c)
+		return latched[ram_bank - 0x08];
+	return 0xff;
+}
+
+void MBC3::write_ram(u8 *, size_t, u16, u8 value)
+{
+	if (ram_bank < 0x08 || ram_bank > 0x0c)
+		return;
+
+	// Writes set the running clock, and show in the latched registers right away
+	u8 registers[5];
+	read_rtc(registers);
+	registers[ram_bank - 0x08] = value;
+	latched[ram_bank - 0x08]   = value;
+	write_rtc(registers);
+}
+
+void MBC3::write_rtc(const u8 registers[5])
+{
+	u64 days    = registers[RTC_DL] | (registers[RTC_DH] & 0x01) << 8;
+	u64 hours   = days * 24 + (registers[RTC_H] & 0x1f);
+	u64 minutes = hours * 60 + (registers[RTC_M] & 0x3f);
+
+	rtc_seconds = minutes * 60 + (registers[RTC_S] & 0x3f);
+	rtc_sync    = time(nullptr);
+	rtc_halted  = registers[RTC_DH] & 0x40;
+	rtc_carry   = registers[RTC_DH] & 0x80;
+}
+
+static void store_le(u8 *bytes, u64 value, int size)
+{
+	for (int i = 0; i < size; i++)
+		bytes[i] = value >> (i * 8);
+}
+
+static u64 load_le(const u8 *bytes, int size)
+{
+	u64 value = 0;
+	for (int i = 0; i < size; i++)
+		value |= static_cast<u64>(bytes[i]) << (i * 8);
+	return value;
+}
+
+void MBC3::save_rtc(u8 trailer[RTC_SAVE_SIZE]) const
+{
+	u8     registers[5];
+	time_t timestamp;
+
+	if (rtc_halted) {
+		to_registers(rtc_seconds, 0x40 | rtc_carry << 7, registers);
+		timestamp = rtc_sync;
+	} else {
+		to_registers(0, rtc_carry << 7, registers);
+		timestamp = rtc_sync - rtc_seconds;
+	}
+
+	for (int i = 0; i < 5; i++) {
+		store_le(trailer + i * 4, registers[i], 4);
+		store_le(trailer + 20 + i * 4, latched[i], 4);
+	}
+	store_le(trailer + 40, timestamp, 8);
+}
+
+void MBC3::load_rtc(const u8 trailer[RTC_SAVE_SIZE])
+{
+	u8 registers[5];
+
+	for (int i = 0; i < 5; i++) {
+		registers[i] = load_le(trailer + i * 4, 4);
+		latched[i]   = load_le(trailer + 20 + i * 4, 4);
+	}
+	write_rtc(registers);
+
+	// The clock has kept running since the save was written
+	rtc_sync = load_le(trailer + 40, 8);
+	sync_rtc();
+}
+
+bool MBC3::same_rtc(const u8 a[RTC_SAVE_SIZE], const u8 b[RTC_SAVE_SIZE])
+{
+	return std::equal(a, a + 20, b) && std::equal(a + 40, a + RTC_SAVE_SIZE, b + 40);
+}
+
+void MBC5::write_register(u16 address, u8 value)
+{
+	if (address <= 0x1fff) {
+		ram_enabled = (value & 0x0f) == 0x0a;
+	} else if (address <= 0x2fff) {
+		rom_bank = (rom_bank & 0x100) | value;
+	} else if (address <= 0x3fff) {
+		rom_bank = (rom_bank & 0xff) | (value & 0x01) << 8;
+	} else if (address <= 0x5fff) {
+		ram_bank = value & 0x0f;
+	}
+}
@@ -0,0 +1,80 @@
+#include <GBMU/MemoryArena.hpp>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <sys/mman.h>
+
+#ifdef GBMU_HUGE_PAGES
+# include <mutex>
+# include <vector>
+#endif
+
+using namespace GBMU;
+
+#ifdef GBMU_HUGE_PAGES
+// A 32 KB arena can't have a huge page of its own: arenas are carved out of huge pages shared by
+// every instance of the process, so that one TLB entry covers the memory of 64 of them. Freed
+// arenas are kept for the next instances
+static constexpr size_t  HUGE_PAGE_SIZE = 2 << 20;
+
+static std::mutex        pool_mutex;
+static std::vector<u8 *> free_arenas;
+
+static u8 *allocate_arena()
+{
+	std::lock_guard<std::mutex> lock(pool_mutex);
+
+	if (free_arenas.empty()) {
+		// Twice the size, to align the huge page on its own size
+		u8 *mapped = reinterpret_cast<u8 *>(mmap(NULL, HUGE_PAGE_SIZE * 2, PROT_READ | PROT_WRITE,
+		                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+		if (mapped == MAP_FAILED)
+			throw std::runtime_error(strerror(errno));
+
+		u8 *chunk = reinterpret_cast<u8 *>(
+		    (reinterpret_cast<uintptr_t>(mapped) + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1));
+		if (chunk > mapped)
+			munmap(mapped, chunk - mapped);
+		munmap(chunk + HUGE_PAGE_SIZE, mapped + HUGE_PAGE_SIZE * 2 - (chunk + HUGE_PAGE_SIZE));
+
+		// Only a hint, the arenas work the same without transparent huge pages
+		madvise(chunk, HUGE_PAGE_SIZE, MADV_HUGEPAGE);
+
+		for (size_t offset = HUGE_PAGE_SIZE; offset > 0; offset -= MemoryArena::SIZE)
+			free_arenas.push_back(chunk + offset - MemoryArena::SIZE);
+	}
+
+	u8 *arena = free_arenas.back();
+	free_arenas.pop_back();
+
+	return arena;
+}
+
+static void free_arena(u8 *arena)
+{
+	std::lock_guard<std::mutex> lock(pool_mutex);
+
+	free_arenas.push_back(arena);
+}
+#else
+static u8 *allocate_arena()
+{
+	u8 *arena = reinterpret_cast<u8 *>(mmap(NULL, MemoryArena::SIZE, PROT_READ | PROT_WRITE,
+	                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0));
+	if (arena == MAP_FAILED)
+		throw std::runtime_error(strerror(errno));
+
+	return arena;
+}
+
+static void free_arena(u8 *arena) { munmap(arena, MemoryArena::SIZE); }
+#endif
+
+MemoryArena::MemoryArena() : memory(allocate_arena())
+{
+	// Arenas reused from the pool still hold the memory of a previous instance
+	std::memset(memory, 0, SIZE);
+}
+
+MemoryArena::~MemoryArena() { free_arena(memory); }
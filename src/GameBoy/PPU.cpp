@@ -1,5 +1,8 @@
 #include <GBMU/GameBoy.hpp>
 #include <GBMU/PPU.hpp>
+#include <bit>
+#include <climits>
+#include <cstring>
 #include <iostream>
 #include <string>
 
@@ -47,11 +50,10 @@ static const u32 PALETTE_COLORS[][4] = {
     {0xD7FFD7FF, 0x6CFF6CFF, 0x00A800FF, 0x002300FF},
 };
 
-PPU::PPU(GameBoy &_gb) : gb(_gb)
+PPU::PPU(GameBoy &_gb)
+    : gb(_gb), hot(_gb.getHotState()), vram(_gb.getArena().at(0x8000), 0x2000),
+      oam(_gb.getArena().at(0xfe00), 0xA0)
 {
-	vram.fill(0);
-	oam.fill(0);
-
 	SDL_Init(SDL_INIT_VIDEO);
 	std::string title = "GBMU - " + gb.getCartridge().getTitle();
 	window   = SDL_CreateWindow(title.c_str(), SDL_WINDOWPOS_CENTERED, SDL_WINDOWPOS_CENTERED,
@@ -61,9 +63,14 @@ PPU::PPU(GameBoy &_gb) : gb(_gb)
 	texture  = SDL_CreateTexture(renderer, SDL_PIXELFORMAT_RGBA8888, SDL_TEXTUREACCESS_STREAMING,
 	                             SCREEN_WIDTH, SCREEN_HEIGHT);
 
+	// Tile data writes go through write_byte to mark the tiles to decode again, reads and tile
+	// map writes stay on the fast path
+	dirty_tiles.fill(~0ull);
 	gb.getMMU().register_handler_range(
-	    0x8000, 0x9fff, [this](u16 addr) { return read_byte(addr); },
+	    0x8000, 0x97ff, [this](u16 addr) { return read_byte(addr); },
 	    [this](u16 addr, u8 value) { write_byte(addr, value); });
+	gb.getMMU().map_memory(0x8000, 0x97ff, vram.data(), nullptr);
+	gb.getMMU().map_memory(0x9800, 0x9fff, &vram[0x1800], &vram[0x1800]);
 	gb.getMMU().register_handler_range(
 	    0xfe00, 0xfe9f, [this](u16 addr) { return read_byte(addr); },
 	    [this](u16 addr, u8 value) { write_byte(addr, value); });
@@ -95,186 +102,250 @@ void PPU::perform_dma()
 
 inline u16 PPU::compute_tile_address(u8 tile_index)
 {
-	if ((lcdc & LCDC::BG_TILE_DATA) == 0)
+	if ((hot.lcdc & LCDC::BG_TILE_DATA) == 0)
 		return 0x1000 + static_cast<s8>(tile_index) * 16;
 	else
 		return tile_index * 16;
 }
 
-void PPU::tick()
-{
-	if (!(lcdc & LCDC::PPU_ENABLE)) {
-		return;
+// Spreads the bits of a tile data byte one per byte, leftmost pixel first in memory, so that a
+// row of 8 pixels decodes with two lookups
+static const std::array<u64, 256> EXPAND = [] {
+	std::array<u64, 256> table;
+
+	for (int byte = 0; byte < 256; byte++) {
+		u64 spread = 0;
+		for (int pixel = 0; pixel < 8; pixel++)
+			spread |= (u64)((byte >> (7 - pixel)) & 1) << (pixel * 8);
+		table[byte] = spread;
 	}
+	return table;
+}();
 
-	cycles++;
+static_assert(std::endian::native == std::endian::little, "EXPAND assumes little endian rows");
 
-	switch (stat & 0b11) {
-	case OAM_SEARCH:
-		if (cycles >= 80) {
-			cycles            = 0;
-			stat              = (stat & ~0b11) | PIXEL_TRANSFER;
-			scanline_rendered = false;
+void PPU::update_tiles()
+{
+	for (int word = 0; word < TILE_COUNT / 64; word++) {
+		for (; dirty_tiles[word]; dirty_tiles[word] &= dirty_tiles[word] - 1) {
+			int tile = word * 64 + std::countr_zero(dirty_tiles[word]);
+
+			for (int address = tile * 16; address < tile * 16 + 16; address += 2) {
+				u64 row         = EXPAND[vram[address]] | EXPAND[vram[address + 1]] << 1;
+				u64 flipped_row = __builtin_bswap64(row);
+
+				std::memcpy(&tiles[address * 4], &row, 8);
+				std::memcpy(&flipped_tiles[address * 4], &flipped_row, 8);
+			}
 		}
-		break;
+	}
+}
 
-	case PIXEL_TRANSFER:
-		if (!scanline_rendered) {
-			u32 *scanline_ptr           = &framebuffer[ly * SCREEN_WIDTH];
+void PPU::render_scanline()
+{
+	u32 *scanline_ptr           = &framebuffer[hot.ly * SCREEN_WIDTH];
+
+	u8  *bg_tile_map            = &vram[(hot.lcdc & LCDC::BG_TILE_MAP) ? 0x1C00 : 0x1800];
+	u8  *win_tile_map           = &vram[(hot.lcdc & LCDC::WINDOW_TILE_MAP) ? 0x1C00 : 0x1800];
 
-			u8  *bg_tile_map            = &vram[(lcdc & LCDC::BG_TILE_MAP) ? 0x1C00 : 0x1800];
-			u8  *win_tile_map           = &vram[(lcdc & LCDC::WINDOW_TILE_MAP) ? 0x1C00 : 0x1800];
+	u8   bg_y                   = hot.ly + scy;
+	u16  bg_tile_row            = (bg_y >> 3) << 5;
+	u8   bg_line                = bg_y % 8;
 
-			u8   bg_y                   = ly + scy;
-			u16  bg_tile_row            = (bg_y >> 3) << 5;
-			u8   bg_line                = bg_y % 8;
+	u8   win_y                  = hot.ly - wy;
+	u16  win_tile_row           = (win_y >> 3) << 5;
+	u8   win_line               = win_y % 8;
 
-			u8   win_y                  = ly - wy;
-			u16  win_tile_row           = (win_y >> 3) << 5;
-			u8   win_line               = win_y % 8;
+	bool obj_long_mode          = hot.lcdc & LCDC::OBJ_HEIGHT;
+	bool is_window_on_that_line = hot.lcdc & LCDC::WINDOW_ENABLE && hot.ly >= wy;
 
-			bool obj_long_mode          = lcdc & LCDC::OBJ_HEIGHT;
-			bool is_window_on_that_line = lcdc & LCDC::WINDOW_ENABLE && ly >= wy;
+	std::vector<struct Sprite *> sprites_on_line;
+	auto                         sprite = sprites.end();
 
-			std::vector<struct Sprite *> sprites_on_line;
-			auto                         sprite = sprites.end();
+	do {
+		sprite--;
 
-			do {
-				sprite--;
+		u8 sprite_y = hot.ly + 16 - sprite->y;
 
-				u8 sprite_y = ly + 16 - sprite->y;
+		if (sprite_y & (obj_long_mode ? 0xF0 : 0xF8))
+			continue;
 
-				if (sprite_y & (obj_long_mode ? 0xF0 : 0xF8))
-					continue;
+		sprites_on_line.push_back(sprite.base());
+	} while (sprite != sprites.begin() && sprites_on_line.size() != 10);
 
-				sprites_on_line.push_back(sprite.base());
-			} while (sprite != sprites.begin() && sprites_on_line.size() != 10);
+	update_tiles();
 
-			for (u8 x = 0; x < SCREEN_WIDTH; x++) {
-				u8 color_index;
+	// Color indices of the line, whole tile rows are written 8 pixels at a time, and the fine
+	// scroll is handled by where they land: pixel x is at x + 8, the margins take the rows that
+	// are cut by the left and right edges
+	u8 line[SCREEN_WIDTH + 16];
 
-				if (is_window_on_that_line && x + 7 >= wx) {
-					/* Window */
-					u8  win_x        = x + 7 - wx;
+	u8 bg_fine = scx % 8;
+	for (int tile = 0; tile <= SCREEN_WIDTH / 8; tile++) {
+		u8  tile_column = ((scx >> 3) + tile) & 0x1F;
+		u16 address     = compute_tile_address(bg_tile_map[bg_tile_row + tile_column]);
 
-					u8  tile_column  = win_x >> 3;
-					u8  tile_index   = win_tile_map[win_tile_row + tile_column];
-					u16 tile_address = compute_tile_address(tile_index);
+		std::memcpy(&line[8 - bg_fine + tile * 8], &tiles[(address + bg_line * 2) * 4], 8);
+	}
 
-					u8  byte1        = vram[tile_address + win_line * 2];
-					u8  byte2        = vram[tile_address + win_line * 2 + 1];
+	// The window covers the background from x = wx - 7 to the right edge
+	if (is_window_on_that_line) {
+		for (int x = wx - 7, tile = 0; x < SCREEN_WIDTH; x += 8, tile++) {
+			u16 address = compute_tile_address(win_tile_map[win_tile_row + (tile & 0x1F)]);
 
-					u8  bit          = 7 - (win_x % 8);
-					color_index      = ((byte2 >> bit) & 1) << 1 | ((byte1 >> bit) & 1);
-				}
+			std::memcpy(&line[8 + x], &tiles[(address + win_line * 2) * 4], 8);
+		}
+	}
 
-				else {
-					/* Background */
-					u8  bg_x         = x + scx;
+	// Palettes are resolved once per line, each pixel is then a single lookup
+	u32 bg_colors[4];
+	for (int color_index = 0; color_index < 4; color_index++)
+		bg_colors[color_index] = PALETTE_COLORS[i][(bgp >> (color_index << 1)) & 0x03];
+
+	u8 *indices = &line[8];
+	for (int x = 0; x < SCREEN_WIDTH; x++)
+		scanline_ptr[x] = bg_colors[indices[x]];
+
+	// Sprites are drawn in the order of the list, each over the previous ones. A drawn sprite
+	// pixel, even transparent, replaces the color index that the priority of the next sprites
+	// is checked against
+	for (auto sprite : sprites_on_line) {
+		u8  sprite_y = hot.ly + 16 - sprite->y;
+
+		u16 tile_address;
+		if (obj_long_mode) {
+			tile_address  = (sprite->index & 0xFE) * 16;
+			tile_address += ((sprite->attr & 0x40) ? (15 - sprite_y) : sprite_y) * 2;
+		} else {
+			tile_address  = sprite->index * 16;
+			tile_address += ((sprite->attr & 0x40) ? (7 - sprite_y) : sprite_y) * 2;
+		}
 
-					u8  tile_column  = bg_x >> 3;
-					u8  tile_index   = bg_tile_map[bg_tile_row + tile_column];
-					u16 tile_address = compute_tile_address(tile_index);
+		const u8 *pixels = &(sprite->attr & 0x20 ? flipped_tiles : tiles)[tile_address * 4];
 
-					u8  byte1        = vram[tile_address + bg_line * 2];
-					u8  byte2        = vram[tile_address + bg_line * 2 + 1];
+		u8        palette = (sprite->attr & 1 << 4) ? obp1 : obp0;
+		u32       colors[4];
+		for (int color_index = 0; color_index < 4; color_index++)
+			colors[color_index] = PALETTE_COLORS[i][(palette >> (color_index << 1)) & 0x03];
 
-					u8  bit          = 7 - (bg_x % 8);
-					color_index      = ((byte2 >> bit) & 1) << 1 | ((byte1 >> bit) & 1);
-				}
+		for (int pixel = 0; pixel < 8; pixel++) {
+			int x = sprite->x - 8 + pixel;
 
-				u8 palette_color = (bgp >> (color_index << 1)) & 0x03;
-				scanline_ptr[x]  = PALETTE_COLORS[i][palette_color];
-
-				for (auto sprite : sprites_on_line) {
-					u8 sprite_y = ly + 16 - sprite->y;
-					u8 sprite_x = x + 8 - sprite->x;
-
-					if ((sprite_x & (obj_long_mode ? 0xF0 : 0xF8)) ||
-					    (sprite->attr & 0x80 && color_index))
-						continue;
-
-					u16 tile_address;
-					if (obj_long_mode) {
-						tile_address  = (sprite->index & 0xFE) * 16;
-						tile_address += ((sprite->attr & 0x40) ? (15 - sprite_y) : sprite_y) * 2;
-					} else {
-						tile_address  = sprite->index * 16;
-						tile_address += ((sprite->attr & 0x40) ? (7 - sprite_y) : sprite_y) * 2;
-					}
-
-					u8 byte1    = vram[tile_address];
-					u8 byte2    = vram[tile_address + 1];
-
-					u8 bit      = (sprite->attr & 0x20) ? sprite_x : (7 - sprite_x);
-
-					color_index = ((byte2 >> bit) & 1) << 1 | ((byte1 >> bit) & 1);
-					if (color_index) {
-						u8 palette_color =
-						    (((sprite->attr & 1 << 4) ? obp1 : obp0) >> (color_index << 1)) & 0x03;
-						scanline_ptr[x] = PALETTE_COLORS[i][palette_color];
-					}
-				}
-			}
+			if (x < 0 || x >= SCREEN_WIDTH || (sprite->attr & 0x80 && indices[x]))
+				continue;
 
-			scanline_rendered = true;
+			indices[x] = pixels[pixel];
+			if (pixels[pixel])
+				scanline_ptr[x] = colors[pixels[pixel]];
 		}
+	}
+}
+
+void PPU::tick(int elapsed)
+{
+	if (!(hot.lcdc & LCDC::PPU_ENABLE)) {
+		return;
+	}
 
-		if (cycles >= 172) {
-			cycles = 0;
-			stat   = (stat & ~0b11) | HBLANK;
-			if (stat & STAT::MODE0) {
-				gb.getCPU().requestInterrupt(CPU::Interrupt::LCD);
+	hot.ppu_cycles += elapsed;
+
+	for (;;) {
+		switch (hot.stat & 0b11) {
+		case OAM_SEARCH:
+			if (hot.ppu_cycles < 80)
+				return;
+
+			hot.ppu_cycles -= 80;
+			hot.stat        = (hot.stat & ~0b11) | PIXEL_TRANSFER;
+			render_scanline();
+			break;
+
+		case PIXEL_TRANSFER:
+			if (hot.ppu_cycles < 172)
+				return;
+
+			hot.ppu_cycles -= 172;
+			hot.stat        = (hot.stat & ~0b11) | HBLANK;
+			if (hot.stat & STAT::MODE0) {
+				hot.interrupt_flags |= CPU::Interrupt::LCD;
 			}
-		}
+			break;
 
-		break;
+		case HBLANK:
+			if (hot.ppu_cycles < 204)
+				return;
 
-	case HBLANK:
-		if (cycles >= 204) {
-			cycles = 0;
-			ly++;
-
-			if (ly == lyc) {
-				stat |= 1 << 2;
-				if (stat & STAT::LYC) {
-					gb.getCPU().requestInterrupt(CPU::Interrupt::LCD);
+			hot.ppu_cycles -= 204;
+			hot.ly++;
+
+			if (hot.ly == hot.lyc) {
+				hot.stat |= 1 << 2;
+				if (hot.stat & STAT::LYC) {
+					hot.interrupt_flags |= CPU::Interrupt::LCD;
 				}
 			}
 
 			else {
-				stat &= ~(1 << 2);
+				hot.stat &= ~(1 << 2);
 			}
 
-			if (ly >= SCREEN_HEIGHT) {
-				gb.getCPU().requestInterrupt(CPU::Interrupt::VBLANK);
-				stat = (stat & ~0b11) | VBLANK;
-				if (stat & STAT::MODE1) {
-					gb.getCPU().requestInterrupt(CPU::Interrupt::LCD);
+			if (hot.ly >= SCREEN_HEIGHT) {
+				hot.interrupt_flags |= CPU::Interrupt::VBLANK;
+				hot.stat             = (hot.stat & ~0b11) | VBLANK;
+				if (hot.stat & STAT::MODE1) {
+					hot.interrupt_flags |= CPU::Interrupt::LCD;
 				}
 			} else {
-				stat = (stat & ~0b11) | OAM_SEARCH;
-				if (stat & STAT::MODE2) {
-					gb.getCPU().requestInterrupt(CPU::Interrupt::LCD);
+				hot.stat = (hot.stat & ~0b11) | OAM_SEARCH;
+				if (hot.stat & STAT::MODE2) {
+					hot.interrupt_flags |= CPU::Interrupt::LCD;
 				}
 			}
-		}
-		break;
+			break;
 
-	case VBLANK:
-		if (cycles >= 456) {
-			cycles = 0;
-			ly++;
+		case VBLANK:
+			if (hot.ppu_cycles < 456)
+				return;
 
-			if (ly >= 154) {
-				ly   = 0;
-				stat = (stat & ~0b11) | OAM_SEARCH;
+			hot.ppu_cycles -= 456;
+			hot.ly++;
+
+			if (hot.ly >= 154) {
+				hot.ly   = 0;
+				hot.stat = (hot.stat & ~0b11) | OAM_SEARCH;
 			}
+			break;
 		}
-		break;
 	}
 }
 
+int PPU::cyclesUntilNextEvent() const
+{
+	if (!(hot.lcdc & LCDC::PPU_ENABLE)) {
+		return INT_MAX;
+	}
+
+	switch (hot.stat & 0b11) {
+	case OAM_SEARCH:
+		return 80 - hot.ppu_cycles;
+	case PIXEL_TRANSFER:
+		return 172 - hot.ppu_cycles;
+	case HBLANK:
+		return 204 - hot.ppu_cycles;
+	default:
+		return 456 - hot.ppu_cycles;
+	}
+}
+
+int PPU::cyclesSinceLastEvent() const
+{
+	if (!(hot.lcdc & LCDC::PPU_ENABLE)) {
+		return INT_MAX;
+	}
+
+	return hot.ppu_cycles;
+}
+
 void PPU::render()
 {
 	SDL_UpdateTexture(texture, nullptr, framebuffer.data(), SCREEN_WIDTH * 4);
@@ -291,17 +362,17 @@ u8 PPU::read_byte(u16 address)
 	} else if (address >= 0xff40 && address <= 0xff4b) {
 		switch (address) {
 		case 0xff40:
-			return lcdc;
+			return hot.lcdc;
 		case 0xff41:
-			return stat;
+			return hot.stat;
 		case 0xff42:
 			return scy;
 		case 0xff43:
 			return scx;
 		case 0xff44:
-			return ly;
+			return hot.ly;
 		case 0xff45:
-			return lyc;
+			return hot.lyc;
 		case 0xff46:
 			return dma;
 		case 0xff47:
@@ -322,16 +393,20 @@ u8 PPU::read_byte(u16 address)
 void PPU::write_byte(u16 address, u8 value)
 {
 	if (address >= 0x8000 && address <= 0x9fff) {
-		vram[address - 0x8000] = value;
+		u16 offset = address - 0x8000;
+
+		if (offset < TILE_COUNT * 16 && vram[offset] != value)
+			dirty_tiles[offset >> 10] |= 1ull << ((offset >> 4) & 63);
+		vram[offset] = value;
 	} else if (address >= 0xfe00 && address <= 0xfe9f) {
 		oam[address - 0xfe00] = value;
 	} else if (address >= 0xff40 && address <= 0xff4b) {
 		switch (address) {
 		case 0xff40:
-			lcdc = value;
+			hot.lcdc = value;
 			break;
 		case 0xff41:
-			stat = value & 0x78;
+			hot.stat = value & 0x78;
 			break;
 		case 0xff42:
 			scy = value;
@@ -340,10 +415,10 @@ void PPU::write_byte(u16 address, u8 value)
 			scx = value;
 			break;
 		case 0xff44:
-			ly = value;
+			hot.ly = value;
 			break;
 		case 0xff45:
-			lyc = value;
+			hot.lyc = value;
 			break;
 		case 0xff46:
 			dma = value;
@@ -0,0 +1,300 @@
+#include <GBMU/RomImage.hpp>
+#include <GBMU/RomPatch.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <stdexcept>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <tuple>
+#include <unistd.h>
+
+using namespace GBMU;
+
+const std::string RomImage::fingerprint_cache_path = "saves/.fingerprints";
+
+// Images loaded by the process, by file (device, inode, size and modification time) so that a
+// file already loaded is never read again, and by fingerprint for copies of the same ROM
+using FileKey    = std::tuple<dev_t, ino_t, off_t, time_t, long>;
+using ContentKey = std::tuple<u64, u64, size_t>;
+using PatchKey   = std::pair<FileKey, FileKey>; // ROM and patch
+
+struct CachedFingerprint {
+	off_t       size;
+	time_t      mtime;
+	long        mtime_nsec;
+	Fingerprint fingerprint;
+};
+
+static std::mutex                                          images_mutex;
+static std::map<FileKey, std::weak_ptr<const RomImage>>    images_by_file;
+static std::map<ContentKey, std::weak_ptr<const RomImage>> images_by_content;
+static std::map<PatchKey, std::weak_ptr<const RomImage>>   patched_images;
+
+static std::map<std::string, CachedFingerprint>            fingerprint_cache;
+static bool                                                fingerprint_cache_loaded = false;
+
+static FileKey file_key(const struct stat &sb)
+{
+	return {sb.st_dev, sb.st_ino, sb.st_size, sb.st_mtim.tv_sec, sb.st_mtim.tv_nsec};
+}
+
+// One line per file: fingerprint, size, modification time in seconds and nanoseconds, then the
+// absolute path up to the end of the line. Patched ROMs are listed by the fingerprint of the ROM
+// and the path of the patch, with the size and time of the patch file
+static void load_fingerprint_cache()
+{
+	std::ifstream     file(RomImage::fingerprint_cache_path);
+	std::string       hex, path;
+	CachedFingerprint entry;
+
+	while (file >> hex >> entry.size >> entry.mtime >> entry.mtime_nsec && file.get() == ' ' &&
+	       std::getline(file, path)) {
+		if (Fingerprint::parse(hex, entry.fingerprint))
+			fingerprint_cache[path] = entry;
+	}
+}
+
+// Adds an entry to the file. Every process restarting updates it: the file is read again under a
+// lock, so that the entries other processes added since are kept, and replaced from a unique
+// temporary file. The cache only saves time, failing to write it is not an error
+static void store_fingerprint_cache(const std::string &rom_path, const CachedFingerprint &entry)
+{
+	std::string     path = RomImage::fingerprint_cache_path;
+	std::error_code error;
+
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path(), error);
+
+	// The file itself is replaced, the lock is taken on another one
+	int lock_fd = open((path + ".lock").c_str(), O_RDWR | O_CREAT, 0644);
+	if (lock_fd < 0)
+		return;
+	while (flock(lock_fd, LOCK_EX) < 0) {
+		if (errno != EINTR) {
+			close(lock_fd);
+			return;
+		}
+	}
+
+	load_fingerprint_cache();
+	fingerprint_cache[rom_path] = entry;
+
+	std::ostringstream content;
+	for (const auto &[cached_path, cached] : fingerprint_cache)
+		content << cached.fingerprint.hex() << ' ' << cached.size << ' ' << cached.mtime << ' '
+		        << cached.mtime_nsec << ' ' << cached_path << '\n';
+
+	std::string data      = content.str();
+	std::string temporary = path + ".XXXXXX";
+	int         fd        = mkstemp(temporary.data());
+	if (fd >= 0) {
+		size_t written = 0;
+		while (written < data.size()) {
+			ssize_t result = write(fd, data.data() + written, data.size() - written);
+			if (result < 0 && errno == EINTR)
+				continue;
+			if (result <= 0)
+				break;
+			written += result;
+		}
+
+		bool complete = written == data.size() && fchmod(fd, 0644) == 0;
+		close(fd);
+		if (!complete || rename(temporary.c_str(), path.c_str()) < 0)
+			unlink(temporary.c_str());
+	}
+
+	close(lock_fd);
+}
+
+static std::string absolute_path(const std::string &filename)
+{
+	return std::filesystem::absolute(filename).lexically_normal().string();
+}
+
+// Hashing the whole ROM is the only part of loading that reads every bank, it is skipped for the
+// files the cache knows unchanged. The entry is found by path, and sb is the stat of the file it
+// depends on
+static Fingerprint fingerprint_file(const std::string &path, const struct stat &sb, const u8 *data,
+                                    size_t size)
+{
+	if (!fingerprint_cache_loaded) {
+		load_fingerprint_cache();
+		fingerprint_cache_loaded = true;
+	}
+
+	auto it = fingerprint_cache.find(path);
+	if (it != fingerprint_cache.end() && it->second.size == sb.st_size &&
+	    it->second.mtime == sb.st_mtim.tv_sec && it->second.mtime_nsec == sb.st_mtim.tv_nsec)
+		return it->second.fingerprint;
+
+	Fingerprint fingerprint = FingerprintHasher::hash(data, size);
+
+	store_fingerprint_cache(path, {sb.st_size, sb.st_mtim.tv_sec, sb.st_mtim.tv_nsec, fingerprint});
+
+	return fingerprint;
+}
+
+// Length of the mapping behind an image, since nothing can't be mapped (empty patch targets)
+static size_t mapping_size(size_t size) { return std::max<size_t>(size, 1); }
+
+RomImage::RomImage(const u8 *_data, size_t _size, const Fingerprint &_fingerprint)
+    : data(_data), size(_size), fingerprint(_fingerprint)
+{
+	// Bank 0 is always mapped, the others are read on demand. Both are only hints
+	madvise(const_cast<u8 *>(data), std::min<size_t>(size, 0x4000), MADV_WILLNEED);
+	madvise(const_cast<u8 *>(data), size, MADV_HUGEPAGE);
+}
+
+RomImage::~RomImage() { munmap(const_cast<u8 *>(data), mapping_size(size)); }
+
+// Image of an open ROM file, images_mutex held. The descriptor stays open
+static std::shared_ptr<const RomImage> load_file(int fd, const std::string &filename,
+                                                 const struct stat &sb)
+{
+	FileKey file = file_key(sb);
+
+	if (std::shared_ptr<const RomImage> image = images_by_file[file].lock())
+		return image;
+
+	// Banks are served straight from the mapping, only the ones the game touches get read
+	int flags = MAP_PRIVATE;
+#ifdef GBMU_POPULATE_ROM
+	flags |= MAP_POPULATE;
+#endif
+	const u8 *mapped =
+	    reinterpret_cast<const u8 *>(mmap(NULL, sb.st_size, PROT_READ, flags, fd, 0));
+	if (mapped == MAP_FAILED)
+		throw std::runtime_error(strerror(errno));
+
+	Fingerprint fingerprint = fingerprint_file(absolute_path(filename), sb, mapped, sb.st_size);
+	ContentKey  content     = {fingerprint.low, fingerprint.high, sb.st_size};
+
+	// A copy of a ROM already loaded shares its image, the new mapping goes away
+	if (std::shared_ptr<const RomImage> other = images_by_content[content].lock()) {
+		munmap(const_cast<u8 *>(mapped), sb.st_size);
+		images_by_file[file] = other;
+		return other;
+	}
+
+	auto image                 = std::make_shared<const RomImage>(mapped, sb.st_size, fingerprint);
+
+	images_by_file[file]       = image;
+	images_by_content[content] = image;
+
+	return image;
+}
+
+std::shared_ptr<const RomImage> RomImage::load(const std::string &filename)
+{
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error(strerror(errno));
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) < 0) {
+		close(fd);
+		throw std::runtime_error(strerror(errno));
+	}
+
+	std::shared_ptr<const RomImage> image;
+	try {
+		std::lock_guard<std::mutex> lock(images_mutex);
+		image = load_file(fd, filename, sb);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+
+	close(fd);
+	return image;
+}
+
+std::shared_ptr<const RomImage> RomImage::load(const std::string &filename,
+                                               const std::string &patch_filename)
+{
+	RomPatch patch(patch_filename);
+
+	// Opened once, for the image of the ROM and the private mapping of the patched one
+	int      fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		throw std::runtime_error(strerror(errno));
+	}
+
+	struct stat rom_sb, patch_sb;
+	if (fstat(fd, &rom_sb) < 0 || stat(patch_filename.c_str(), &patch_sb) < 0) {
+		close(fd);
+		throw std::runtime_error(strerror(errno));
+	}
+
+	PatchKey                        key = {file_key(rom_sb), file_key(patch_sb)};
+	std::lock_guard<std::mutex>     lock(images_mutex);
+	std::shared_ptr<const RomImage> base;
+	size_t                          size;
+
+	if (std::shared_ptr<const RomImage> image = patched_images[key].lock()) {
+		close(fd);
+		return image;
+	}
+
+	try {
+		base = load_file(fd, filename, rom_sb);
+		size = patch.targetSize(base->data, base->size);
+	} catch (...) {
+		close(fd);
+		throw;
+	}
+
+	// Zeroed memory for what the patch adds past the end of the ROM, with the ROM file mapped
+	// privately over the start
+	size_t mapped_size = mapping_size(size);
+	size_t shared      = std::min(size, base->size);
+	void  *memory      =
+	    mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (memory == MAP_FAILED) {
+		close(fd);
+		throw std::runtime_error(strerror(errno));
+	}
+
+	int flags = MAP_PRIVATE | MAP_FIXED;
+	if (shared && mmap(memory, shared, PROT_READ | PROT_WRITE, flags, fd, 0) == MAP_FAILED) {
+		int error = errno;
+		munmap(memory, mapped_size);
+		close(fd);
+		throw std::runtime_error(strerror(error));
+	}
+
+	close(fd);
+
+	u8 *target = static_cast<u8 *>(memory);
+	try {
+		patch.apply(base->data, base->size, target, size);
+	} catch (...) {
+		munmap(memory, mapped_size);
+		throw;
+	}
+
+	if (mprotect(memory, mapped_size, PROT_READ) < 0) {
+		int error = errno;
+		munmap(memory, mapped_size);
+		throw std::runtime_error(strerror(error));
+	}
+
+	// The fingerprint is the one of the patched ROM, as if it had been written to a file, so that
+	// it finds the same save. It is cached for the ROM, by fingerprint, and the patch file
+	std::string path        = base->fingerprint.hex() + ' ' + absolute_path(patch_filename);
+	Fingerprint fingerprint = fingerprint_file(path, patch_sb, target, size);
+
+	auto        image       = std::make_shared<const RomImage>(target, size, fingerprint);
+	patched_images[key]     = image;
+
+	return image;
+}
@@ -0,0 +1,249 @@
+#include <GBMU/RomIndex.hpp>
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+using namespace GBMU;
+
+RomIndex::RomIndex(const std::string &index_path)
+{
+	int fd = open(index_path.c_str(), O_RDONLY);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return;
+		throw std::runtime_error(strerror(errno));
+	}
+
+	struct stat sb;
+	if (fstat(fd, &sb) < 0) {
+		close(fd);
+		throw std::runtime_error(strerror(errno));
+	}
+
+	if (sb.st_size < (off_t)sizeof(FileHeader)) {
+		close(fd);
+		throw std::runtime_error("Invalid ROM index");
+	}
+
+	void *mapped = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (mapped == MAP_FAILED) {
+		close(fd);
+		throw std::runtime_error(strerror(errno));
+	}
+
+	close(fd);
+
+	mapping_size = sb.st_size;
+	mapping      = static_cast<const u8 *>(mapped);
+
+	const FileHeader *header = reinterpret_cast<const FileHeader *>(mapping);
+	entries                  = reinterpret_cast<const Entry *>(mapping + sizeof(FileHeader));
+	paths                    = reinterpret_cast<const char *>(entries + header->count);
+	count                    = header->count;
+
+	// Checked once here, so that lookups can trust every offset
+	bool valid = std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) == 0 &&
+	             sizeof(FileHeader) + (u64)count * sizeof(Entry) + header->paths_size ==
+	                 mapping_size;
+	for (u32 i = 0; valid && i < count; i++)
+		valid = (u64)entries[i].path_offset + entries[i].path_length <= header->paths_size;
+
+	if (!valid) {
+		munmap(const_cast<u8 *>(mapping), mapping_size);
+		mapping = nullptr;
+		count   = 0;
+		throw std::runtime_error("Invalid ROM index");
+	}
+}
+
+RomIndex::~RomIndex()
+{
+	if (mapping)
+		munmap(const_cast<u8 *>(mapping), mapping_size);
+}
+
+std::string_view RomIndex::pathOf(const Entry &entry) const
+{
+	return std::string_view(paths + entry.path_offset, entry.path_length);
+}
+
+const RomIndex::Entry *RomIndex::find(std::string_view path) const
+{
+	const Entry *end   = entries + count;
+	const Entry *entry = std::lower_bound(
+	    entries, end, path, [this](const Entry &e, std::string_view p) { return pathOf(e) < p; });
+
+	if (entry == end || pathOf(*entry) != path)
+		return nullptr;
+	return entry;
+}
+
+struct IndexedRom {
+	std::string     path; // Relative to the indexed directory
+	RomIndex::Entry entry{};
+	bool            indexed = false;
+	bool            read    = false;
+};
+
+static bool is_rom(const std::filesystem::path &path)
+{
+	std::string extension = path.extension().string();
+
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	return extension == ".gb" || extension == ".gbc" || extension == ".sgb";
+}
+
+// Fills the entry of one file, from the previous index if the file didn't change since
+static void index_rom(const std::filesystem::path &directory, const RomIndex *previous,
+                      bool global_checksums, IndexedRom &rom)
+{
+	std::string filename = (directory / rom.path).string();
+	struct stat sb;
+
+	auto        describe = [&rom, &sb] {
+		rom.entry.size  = sb.st_size;
+		rom.entry.mtime = (s64)sb.st_mtim.tv_sec * 1000000000 + sb.st_mtim.tv_nsec;
+	};
+
+	// Unchanged files are not even opened
+	if (stat(filename.c_str(), &sb) < 0) {
+		std::cerr << filename << ": " << strerror(errno) << std::endl;
+		return;
+	}
+	describe();
+
+	const RomIndex::Entry *cached = previous ? previous->find(rom.path) : nullptr;
+	if (cached && cached->size == rom.entry.size && cached->mtime == rom.entry.mtime &&
+	    (!global_checksums || cached->flags & RomIndex::GLOBAL_CHECKSUM_CHECKED)) {
+		rom.entry.header = cached->header;
+		rom.entry.flags  = cached->flags;
+		rom.indexed      = true;
+		return;
+	}
+
+	int fd = open(filename.c_str(), O_RDONLY);
+	if (fd < 0) {
+		std::cerr << filename << ": " << strerror(errno) << std::endl;
+		return;
+	}
+
+	// The file may have been replaced since, describe the one being read
+	if (fstat(fd, &sb) < 0) {
+		std::cerr << filename << ": " << strerror(errno) << std::endl;
+		close(fd);
+		return;
+	}
+	describe();
+
+	// Only the header is read, unless the global checksum has to be computed
+	try {
+		rom.entry.header = CartridgeHeader::read(fd);
+	} catch (const std::runtime_error &error) {
+		std::cerr << filename << ": " << error.what() << std::endl;
+		close(fd);
+		return;
+	}
+
+	if (rom.entry.header.isHeaderChecksumValid())
+		rom.entry.flags |= RomIndex::HEADER_CHECKSUM_VALID;
+
+	if (global_checksums && sb.st_size > 0) {
+		void *data = mmap(NULL, sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (data != MAP_FAILED) {
+			u16 checksum = CartridgeHeader::computeGlobalChecksum(static_cast<const u8 *>(data),
+			                                                      sb.st_size);
+
+			rom.entry.flags |= RomIndex::GLOBAL_CHECKSUM_CHECKED;
+			if (checksum == rom.entry.header.getGlobalChecksum())
+				rom.entry.flags |= RomIndex::GLOBAL_CHECKSUM_VALID;
+			munmap(data, sb.st_size);
+		}
+	}
+
+	close(fd);
+	rom.indexed = true;
+	rom.read    = true;
+}
+
+size_t RomIndex::build(const std::string &directory, const std::string &index_path,
+                       unsigned threads, bool global_checksums)
+{
+	// A broken index is rebuilt from scratch
+	std::unique_ptr<RomIndex> previous;
+	try {
+		previous = std::make_unique<RomIndex>(index_path);
+	} catch (const std::runtime_error &) {
+	}
+
+	std::vector<IndexedRom> roms;
+	for (const auto &file : std::filesystem::recursive_directory_iterator(
+	         directory, std::filesystem::directory_options::skip_permission_denied)) {
+		if (file.is_regular_file() && is_rom(file.path()))
+			roms.push_back({std::filesystem::relative(file.path(), directory).string()});
+	}
+	std::sort(roms.begin(), roms.end(),
+	          [](const IndexedRom &a, const IndexedRom &b) { return a.path < b.path; });
+
+	// Headers are tiny, the time goes into opening files: many threads hide the latency of the
+	// file system, most of all on network ones
+	std::atomic<size_t>      next = 0;
+	std::vector<std::thread> pool;
+	for (unsigned i = 0; i < std::max(threads, 1u); i++) {
+		pool.emplace_back([&] {
+			for (size_t index; (index = next++) < roms.size();)
+				index_rom(directory, previous.get(), global_checksums, roms[index]);
+		});
+	}
+	for (std::thread &thread : pool)
+		thread.join();
+
+	std::erase_if(roms, [](const IndexedRom &rom) { return !rom.indexed; });
+
+	FileHeader header;
+	std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+	header.count      = roms.size();
+	header.paths_size = 0;
+
+	for (IndexedRom &rom : roms) {
+		rom.entry.path_offset = header.paths_size;
+		rom.entry.path_length = rom.path.size();
+		header.paths_size    += rom.path.size();
+	}
+
+	// Replaced atomically, readers that mapped the previous index keep it
+	std::string temporary = index_path + ".tmp";
+	FILE       *file      = fopen(temporary.c_str(), "wb");
+	if (!file)
+		throw std::runtime_error(strerror(errno));
+
+	fwrite(&header, sizeof(header), 1, file);
+	for (const IndexedRom &rom : roms)
+		fwrite(&rom.entry, sizeof(rom.entry), 1, file);
+	for (const IndexedRom &rom : roms)
+		fwrite(rom.path.data(), 1, rom.path.size(), file);
+
+	if (fflush(file) != 0 || fsync(fileno(file)) < 0) {
+		int error = errno;
+		fclose(file);
+		unlink(temporary.c_str());
+		throw std::runtime_error(strerror(error));
+	}
+	fclose(file);
+
+	if (rename(temporary.c_str(), index_path.c_str()) < 0)
+		throw std::runtime_error(strerror(errno));
+
+	return std::count_if(roms.begin(), roms.end(), [](const IndexedRom &rom) { return rom.read; });
+}
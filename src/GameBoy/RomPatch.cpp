@@ -0,0 +1,234 @@
+#include <GBMU/RomPatch.hpp>
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+
+using namespace GBMU;
+
+static const std::array<u32, 256> CRC32_TABLE = [] {
+	std::array<u32, 256> table;
+
+	for (u32 i = 0; i < 256; i++) {
+		u32 crc = i;
+		for (int bit = 0; bit < 8; bit++)
+			crc = crc & 1 ? (crc >> 1) ^ 0xedb88320 : crc >> 1;
+		table[i] = crc;
+	}
+	return table;
+}();
+
+static u32 crc32(const u8 *data, size_t size)
+{
+	u32 crc = 0xffffffff;
+
+	for (size_t i = 0; i < size; i++)
+		crc = CRC32_TABLE[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+	return ~crc;
+}
+
+static u32 read32le(const u8 *data)
+{
+	return data[0] | data[1] << 8 | data[2] << 16 | (u32)data[3] << 24;
+}
+
+// Writes one byte of the patched ROM, leaving its page alone when the byte doesn't change
+static void put(u8 *target, size_t target_size, size_t offset, u8 value)
+{
+	if (offset >= target_size)
+		throw std::runtime_error("Corrupted patch");
+	if (target[offset] != value)
+		target[offset] = value;
+}
+
+// Bounds-checked reads through a patch
+struct PatchReader {
+	const u8 *data;
+	size_t    size;
+	size_t    offset = 0;
+
+	u8        byte()
+	{
+		if (offset >= size)
+			throw std::runtime_error("Truncated patch");
+		return data[offset++];
+	}
+
+	u32 big_endian(int bytes)
+	{
+		u32 value = 0;
+		while (bytes--)
+			value = value << 8 | byte();
+		return value;
+	}
+
+	// BPS variable-length number
+	u64 number()
+	{
+		u64 value = 0;
+		u64 shift = 1;
+
+		while (true) {
+			u8 x   = byte();
+			value += (x & 0x7f) * shift;
+			if (x & 0x80)
+				return value;
+			shift <<= 7;
+			value  += shift;
+		}
+	}
+};
+
+static constexpr u32 IPS_EOF = 0x454f46; // "EOF", where a record offset would be
+
+RomPatch::RomPatch(const std::string &filename)
+{
+	std::ifstream file(filename, std::ios::binary);
+	if (!file)
+		throw std::runtime_error(filename + ": " + strerror(errno));
+
+	data.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+
+	if (data.size() >= 8 && std::memcmp(data.data(), "PATCH", 5) == 0) {
+		format = Format::IPS;
+	} else if (data.size() >= 16 && std::memcmp(data.data(), "BPS1", 4) == 0) {
+		format = Format::BPS;
+		if (crc32(data.data(), data.size() - 4) != read32le(data.data() + data.size() - 4))
+			throw std::runtime_error(filename + ": corrupted patch");
+	} else {
+		throw std::runtime_error(filename + ": not an IPS or BPS patch");
+	}
+}
+
+bool RomPatch::isPatchFile(const std::string &filename)
+{
+	std::string extension = filename.size() >= 4 ? filename.substr(filename.size() - 4) : "";
+
+	std::transform(extension.begin(), extension.end(), extension.begin(), ::tolower);
+	return extension == ".ips" || extension == ".bps";
+}
+
+size_t RomPatch::targetSize(const u8 *source, size_t source_size) const
+{
+	PatchReader reader{data.data(), data.size()};
+
+	if (format == Format::BPS) {
+		reader.offset = 4;
+		if (reader.number() != source_size ||
+		    crc32(source, source_size) != read32le(data.data() + data.size() - 12))
+			throw std::runtime_error("The patch is for another ROM");
+		return reader.number();
+	}
+
+	// IPS records may write past the end of the ROM, and a truncation may follow the end marker
+	size_t size   = source_size;
+
+	reader.offset = 5;
+	for (u32 offset; (offset = reader.big_endian(3)) != IPS_EOF;) {
+		u32 length = reader.big_endian(2);
+
+		if (length == 0) {
+			length         = reader.big_endian(2);
+			reader.offset += 1;
+		} else {
+			reader.offset += length;
+		}
+		size = std::max<size_t>(size, offset + length);
+	}
+
+	if (reader.offset + 3 <= data.size())
+		size = reader.big_endian(3);
+
+	return size;
+}
+
+void RomPatch::apply(const u8 *source, size_t source_size, u8 *target, size_t target_size) const
+{
+	if (format == Format::IPS)
+		apply_ips(target, target_size);
+	else
+		apply_bps(source, source_size, target, target_size);
+}
+
+void RomPatch::apply_ips(u8 *target, size_t target_size) const
+{
+	PatchReader reader{data.data(), data.size(), 5};
+
+	// Records past a truncation are dropped
+	for (u32 offset; (offset = reader.big_endian(3)) != IPS_EOF;) {
+		u32 length = reader.big_endian(2);
+
+		if (length == 0) {
+			u32 count = reader.big_endian(2);
+			u8  value = reader.byte();
+
+			for (u32 i = 0; i < count && offset + i < target_size; i++)
+				put(target, target_size, offset + i, value);
+		} else {
+			for (u32 i = 0; i < length; i++) {
+				u8 value = reader.byte();
+				if (offset + i < target_size)
+					put(target, target_size, offset + i, value);
+			}
+		}
+	}
+}
+
+void RomPatch::apply_bps(const u8 *source, size_t source_size, u8 *target,
+                         size_t target_size) const
+{
+	// Actions stop before the three checksums
+	PatchReader reader{data.data(), data.size() - 12, 4};
+
+	reader.number();
+	reader.number();
+	reader.offset += reader.number(); // Metadata
+
+	// Output bytes are written once each, in order. Until then a byte of target still holds the
+	// byte of source at the same offset, which is what SourceRead copies
+	size_t output        = 0;
+	s64    source_offset = 0;
+	s64    target_offset = 0;
+
+	while (reader.offset < reader.size) {
+		u64 command = reader.number();
+		u64 length  = (command >> 2) + 1;
+
+		switch (command & 3) {
+		case 0: // SourceRead
+			if (output + length > std::min(source_size, target_size))
+				throw std::runtime_error("Corrupted patch");
+			output += length;
+			break;
+		case 1: // TargetRead
+			while (length--)
+				put(target, target_size, output++, reader.byte());
+			break;
+		case 2: { // SourceCopy
+			u64 delta      = reader.number();
+			source_offset += delta & 1 ? -(s64)(delta >> 1) : (s64)(delta >> 1);
+			while (length--) {
+				if (source_offset < 0 || (size_t)source_offset >= source_size)
+					throw std::runtime_error("Corrupted patch");
+				put(target, target_size, output++, source[source_offset++]);
+			}
+			break;
+		}
+		case 3: { // TargetCopy
+			u64 delta      = reader.number();
+			target_offset += delta & 1 ? -(s64)(delta >> 1) : (s64)(delta >> 1);
+			while (length--) {
+				if (target_offset < 0 || (size_t)target_offset >= output)
+					throw std::runtime_error("Corrupted patch");
+				put(target, target_size, output++, target[target_offset++]);
+			}
+			break;
+		}
+		}
+	}
+
+	if (crc32(target, target_size) != read32le(data.data() + data.size() - 8))
+		throw std::runtime_error("The patched ROM doesn't match the patch checksum");
+}
@@ -0,0 +1,140 @@
+#include <GBMU/SaveWriter.hpp>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <iostream>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace GBMU;
+
+SaveWriter::SaveWriter() : thread(&SaveWriter::run, this) {}
+
+SaveWriter::~SaveWriter()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+	}
+	wake.notify_one();
+	thread.join();
+}
+
+SaveWriter &SaveWriter::get()
+{
+	static SaveWriter writer;
+
+	return writer;
+}
+
+void SaveWriter::submit(const std::string &path, std::vector<u8> data)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		pending[path] = std::move(data);
+	}
+	wake.notify_one();
+}
+
+bool SaveWriter::take_failure(const std::string &path)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+
+	return failed.erase(path);
+}
+
+void SaveWriter::flush()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	idle.wait(lock, [this] { return pending.empty() && !writing; });
+}
+
+void SaveWriter::run()
+{
+	std::unique_lock<std::mutex> lock(mutex);
+
+	while (true) {
+		wake.wait(lock, [this] { return !pending.empty() || stopping; });
+
+		// Pending saves are written before stopping
+		if (pending.empty())
+			break;
+
+		auto node = pending.extract(pending.begin());
+		writing   = true;
+		lock.unlock();
+
+		auto start   = std::chrono::steady_clock::now();
+		bool saved   = write_file(node.key(), node.mapped());
+		auto elapsed = std::chrono::steady_clock::now() - start;
+
+		if (saved)
+			std::cerr << "Saved " << node.key() << " in "
+			          << std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count()
+			          << " us" << std::endl;
+
+		lock.lock();
+		if (saved)
+			failed.erase(node.key());
+		else
+			failed.insert(node.key());
+		writing = false;
+		if (pending.empty())
+			idle.notify_all();
+	}
+}
+
+bool SaveWriter::write_file(const std::string &path, const std::vector<u8> &data)
+{
+	// A crash leaves either the previous save or the new one, never a mix of both. The temporary
+	// file is unique, processes running the same ROM share the save path
+	std::string temporary = path + ".XXXXXX";
+
+	int         fd        = mkstemp(temporary.data());
+	if (fd < 0) {
+		std::cerr << "Could not write " << temporary << ": " << strerror(errno) << std::endl;
+		return false;
+	}
+
+	size_t written = 0;
+	while (written < data.size()) {
+		ssize_t result = write(fd, data.data() + written, data.size() - written);
+		if (result < 0 && errno == EINTR)
+			continue;
+		if (result <= 0) {
+			if (result == 0)
+				errno = EIO;
+			break;
+		}
+		written += result;
+	}
+
+	// mkstemp only lets the owner read the file
+	if (written < data.size() || fchmod(fd, 0644) < 0 || fsync(fd) < 0) {
+		std::cerr << "Could not write " << temporary << ": " << strerror(errno) << std::endl;
+		close(fd);
+		unlink(temporary.c_str());
+		return false;
+	}
+	close(fd);
+
+	if (rename(temporary.c_str(), path.c_str()) < 0) {
+		std::cerr << "Could not replace " << path << ": " << strerror(errno) << std::endl;
+		unlink(temporary.c_str());
+		return false;
+	}
+
+	// The rename itself only lasts once the directory is synced
+	std::string directory = std::filesystem::path(path).parent_path().string();
+	int         dir_fd    = open(directory.empty() ? "." : directory.c_str(), O_RDONLY);
+	if (dir_fd >= 0) {
+		fsync(dir_fd);
+		close(dir_fd);
+	}
+
+	return true;
+}
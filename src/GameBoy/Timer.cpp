@@ -1,9 +1,10 @@
 #include <GBMU/GameBoy.hpp>
 #include <GBMU/Timer.hpp>
+#include <climits>
 
 using namespace GBMU;
 
-Timer::Timer(GameBoy &_gb) : gb(_gb)
+Timer::Timer(GameBoy &_gb) : gb(_gb), hot(_gb.getHotState())
 {
 	gb.getMMU().register_handler_range(
 	    0xff04, 0xff07, [this](u16 addr) { return read_byte(addr); },
@@ -16,13 +17,13 @@ u8 Timer::read_byte(u16 address)
 {
 	switch (address) {
 	case 0xff04:
-		return (div_counter >> 8) & 0xff;
+		return (hot.div_counter >> 8) & 0xff;
 	case 0xff05:
-		return tima;
+		return hot.tima;
 	case 0xff06:
-		return tma;
+		return hot.tma;
 	case 0xff07:
-		return tac;
+		return hot.tac;
 	default:
 		return 0;
 	}
@@ -32,47 +33,55 @@ void Timer::write_byte(u16 address, u8 value)
 {
 	switch (address) {
 	case 0xff04:
-		div_counter = 0;
+		hot.div_counter = 0;
 		break;
 	case 0xff05:
-		tima = value;
+		hot.tima = value;
 		break;
 	case 0xff06:
-		tma = value;
+		hot.tma = value;
 		break;
 	case 0xff07:
-		tac = value;
+		hot.tac = value;
 		break;
 	}
 }
 
-void Timer::tick()
+int Timer::threshold() const
 {
-	div_counter++;
+	switch (hot.tac & 0x03) {
+	case 0:
+		return 1024;
+	case 1:
+		return 16;
+	case 2:
+		return 64;
+	default:
+		return 256;
+	}
+}
 
-	if (tac & 0x04) {
-		int threshold;
-		switch (tac & 0x03) {
-		case 0:
-			threshold = 1024;
-			break;
-		case 1:
-			threshold = 16;
-			break;
-		case 2:
-			threshold = 64;
-			break;
-		case 3:
-			threshold = 256;
-			break;
-		}
+void Timer::tick(int cycles)
+{
+	hot.div_counter += cycles;
 
-		if (++timer_counter >= threshold) {
-			timer_counter = 0;
-			if (++tima == 0) {
-				gb.getCPU().requestInterrupt(CPU::Interrupt::TIMER);
-				tima = tma;
+	if (hot.tac & 0x04) {
+		hot.timer_counter += cycles;
+
+		while (hot.timer_counter >= threshold()) {
+			hot.timer_counter -= threshold();
+			if (++hot.tima == 0) {
+				hot.interrupt_flags |= CPU::Interrupt::TIMER;
+				hot.tima             = hot.tma;
 			}
 		}
 	}
 }
+
+int Timer::cyclesUntilOverflow() const
+{
+	if (!(hot.tac & 0x04))
+		return INT_MAX;
+
+	return (0xff - hot.tima) * threshold() + (threshold() - hot.timer_counter);
+}
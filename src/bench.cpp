@@ -0,0 +1,94 @@
+#include <GBMU/GameBoy.hpp>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <linux/perf_event.h>
+#include <memory>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+
+// Headless frame benchmark: runs instances of a ROM one frame at a time each, round robin, as when
+// packing many of them per core, and reports the time and L1 data cache read misses per frame.
+//
+//   bench game.gb 600 8
+//
+// Misses are counted with perf_event_open, and reported as unavailable when the kernel or the
+// hardware does not allow it (perf_event_paranoid, virtual machines).
+
+using namespace GBMU;
+
+// Counter of L1 data cache read misses of this thread, or -1
+static int open_l1d_misses()
+{
+	perf_event_attr attr{};
+
+	attr.type           = PERF_TYPE_HW_CACHE;
+	attr.size           = sizeof(attr);
+	attr.config         = PERF_COUNT_HW_CACHE_L1D | PERF_COUNT_HW_CACHE_OP_READ << 8 |
+	                      PERF_COUNT_HW_CACHE_RESULT_MISS << 16;
+	attr.disabled       = 1;
+	attr.exclude_kernel = 1;
+	attr.exclude_hv     = 1;
+
+	return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc < 2 || argc > 4) {
+		std::cerr << "Usage: " << argv[0] << " <rom> [<frames> [<instances>]]" << std::endl;
+		return 1;
+	}
+
+	// Nothing to show or play
+	setenv("SDL_VIDEODRIVER", "dummy", 0);
+	setenv("SDL_AUDIODRIVER", "dummy", 0);
+
+	u64                                   frames    = argc > 2 ? std::stoull(argv[2]) : 600;
+	size_t                                count     = argc > 3 ? std::stoul(argv[3]) : 1;
+	std::vector<std::unique_ptr<GameBoy>> instances;
+
+	for (size_t i = 0; i < count; i++)
+		instances.push_back(std::make_unique<GameBoy>(argv[1]));
+
+	int  counter = open_l1d_misses();
+	int  error   = counter < 0 ? errno : 0;
+	u64  misses  = 0;
+
+	auto start   = std::chrono::steady_clock::now();
+	if (counter >= 0) {
+		ioctl(counter, PERF_EVENT_IOC_RESET, 0);
+		ioctl(counter, PERF_EVENT_IOC_ENABLE, 0);
+	}
+
+	for (u64 frame = 0; frame < frames; frame++)
+		for (auto &gb : instances)
+			gb->compute_frame();
+
+	if (counter >= 0) {
+		ioctl(counter, PERF_EVENT_IOC_DISABLE, 0);
+		if (read(counter, &misses, sizeof(misses)) != sizeof(misses))
+			error = errno;
+	}
+	auto end   = std::chrono::steady_clock::now();
+
+	u64  total = frames * count;
+	auto ns    = std::chrono::duration_cast<std::chrono::nanoseconds>(end - start).count();
+
+	std::cout << total << " frames (" << count << " instances, " << sizeof(GameBoy)
+	          << " bytes each)\n  Time per frame: " << std::fixed << std::setprecision(1)
+	          << ns / 1000.0 / total << " us\n  L1D read misses per frame: ";
+	if (!error)
+		std::cout << std::setprecision(0) << static_cast<double>(misses) / total << std::endl;
+	else
+		std::cout << "unavailable (" << strerror(error) << ")" << std::endl;
+
+	if (counter >= 0)
+		close(counter);
+
+	return 0;
+}
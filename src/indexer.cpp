@@ -0,0 +1,69 @@
+#include <GBMU/RomIndex.hpp>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <thread>
+
+// ROM library indexer: reads the header of every ROM under a directory, and only the header, into
+// an index that lookups map as is. Rebuilding an index only reads the files that changed.
+//
+//   indexer build <directory> <index> [--global-checksums]
+//   indexer show <index> [<path relative to the directory>...]
+
+using namespace GBMU;
+
+static void print_entry(const RomIndex &index, const RomIndex::Entry &entry)
+{
+	const CartridgeHeader &header = entry.header;
+
+	std::cout << index.pathOf(entry) << "\n  Title: " << header.getTitle()
+	          << "\n  Type: " << header.getCartridgeTypeString() << "\n  ROM Size: 0x"
+	          << std::hex << std::setw(2) << std::setfill('0') << (int)header.getRomSize()
+	          << std::dec << " (" << entry.size / 1024 << " KB)\n  RAM Size: 0x" << std::hex
+	          << std::setw(2) << (int)header.getRamSize() << "\n  License: 0x" << std::setw(2)
+	          << (int)header.getLicenseCode() << std::dec << "\n  Header checksum: "
+	          << (entry.flags & RomIndex::HEADER_CHECKSUM_VALID ? "valid" : "invalid");
+	if (entry.flags & RomIndex::GLOBAL_CHECKSUM_CHECKED)
+		std::cout << "\n  Global checksum: "
+		          << (entry.flags & RomIndex::GLOBAL_CHECKSUM_VALID ? "valid" : "invalid");
+	std::cout << std::endl;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc >= 4 && strcmp(argv[1], "build") == 0) {
+		bool     global_checksums = argc > 4 && strcmp(argv[4], "--global-checksums") == 0;
+		unsigned threads          = std::max(std::thread::hardware_concurrency(), 1u) * 4;
+
+		size_t   files_read       = RomIndex::build(argv[2], argv[3], threads, global_checksums);
+		RomIndex index(argv[3]);
+
+		std::cerr << index.size() << " ROMs indexed, " << files_read << " read" << std::endl;
+		return 0;
+	}
+
+	if (argc >= 3 && strcmp(argv[1], "show") == 0) {
+		RomIndex index(argv[2]);
+		int      missing = 0;
+
+		if (argc == 3) {
+			for (u32 i = 0; i < index.size(); i++)
+				print_entry(index, index.at(i));
+		}
+
+		for (int i = 3; i < argc; i++) {
+			if (const RomIndex::Entry *entry = index.find(argv[i])) {
+				print_entry(index, *entry);
+			} else {
+				std::cerr << argv[i] << ": not in the index" << std::endl;
+				missing++;
+			}
+		}
+
+		return missing ? 1 : 0;
+	}
+
+	std::cerr << "Usage: " << argv[0] << " build <directory> <index> [--global-checksums]\n"
+	          << "       " << argv[0] << " show <index> [<path>...]" << std::endl;
+	return 1;
+}
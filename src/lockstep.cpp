@@ -0,0 +1,157 @@
+#include <GBMU/GameBoy.hpp>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+
+// Lockstep check of native code: runs a ROM twice, with and without native blocks (translated by
+// the Dynarec, or loaded from a shared object), and compares both Game Boys whenever they reach the
+// same cycle. Native steps run several instructions at once, the interpreter catches up with one
+// instruction at a time.
+//
+//   lockstep game.gb 600 [game.so]
+//
+// Exits with 1 at the first difference, printing where the native step that led to it started.
+
+using namespace GBMU;
+
+// Description of the first difference between the two Game Boys, empty when they match
+static std::string compare(GameBoy &native, GameBoy &reference)
+{
+	std::stringstream ss;
+	HotState         &a = native.getHotState();
+	HotState         &b = reference.getHotState();
+
+	auto check = [&](const char *name, long actual, long expected) {
+		if (actual != expected && ss.tellp() == 0)
+			ss << name << " is 0x" << std::hex << actual << " instead of 0x" << expected;
+	};
+
+	check("af", a.registers.af, b.registers.af);
+	check("bc", a.registers.bc, b.registers.bc);
+	check("de", a.registers.de, b.registers.de);
+	check("hl", a.registers.hl, b.registers.hl);
+	check("sp", a.registers.sp, b.registers.sp);
+	check("pc", a.registers.pc, b.registers.pc);
+	check("lazy.op", a.lazy.op, b.lazy.op);
+	check("lazy.left", a.lazy.left, b.lazy.left);
+	check("lazy.right", a.lazy.right, b.lazy.right);
+	check("lazy.result", a.lazy.result, b.lazy.result);
+	check("interrupt_flags", a.interrupt_flags, b.interrupt_flags);
+	check("interrupt_enable", a.interrupt_enable, b.interrupt_enable);
+	check("ime", a.ime, b.ime);
+	check("enable_interrupt_delay", a.enable_interrupt_delay, b.enable_interrupt_delay);
+	check("halted", a.halted, b.halted);
+	check("ppu_cycles", a.ppu_cycles, b.ppu_cycles);
+	check("lcdc", a.lcdc, b.lcdc);
+	check("stat", a.stat, b.stat);
+	check("ly", a.ly, b.ly);
+	check("lyc", a.lyc, b.lyc);
+	check("div_counter", a.div_counter, b.div_counter);
+	check("tima", a.tima, b.tima);
+	check("tma", a.tma, b.tma);
+	check("tac", a.tac, b.tac);
+	check("timer_counter", a.timer_counter, b.timer_counter);
+	check("frame_cycles", a.frame_cycles, b.frame_cycles);
+	check("rom_bank0", native.getCartridge().getRomBank0(), reference.getCartridge().getRomBank0());
+	check("rom_bank", native.getCartridge().getRomBank(), reference.getCartridge().getRomBank());
+
+	// Offset of the first byte that differs
+	auto mismatch = [](const u8 *actual, const u8 *expected, size_t size) -> long {
+		if (memcmp(actual, expected, size) == 0)
+			return -1;
+		return std::mismatch(actual, actual + size, expected).first - actual;
+	};
+
+	if (long offset = mismatch(native.getArena().data(), reference.getArena().data(),
+	                           MemoryArena::SIZE);
+	    offset >= 0 && ss.tellp() == 0)
+		ss << "memory at 0x" << std::hex << MemoryArena::BASE + offset << " differs";
+
+	if (long offset = mismatch(native.getCartridge().getRamData(),
+	                           reference.getCartridge().getRamData(),
+	                           native.getCartridge().getRamDataSize());
+	    offset >= 0 && ss.tellp() == 0)
+		ss << "cartridge RAM at 0x" << std::hex << offset << " differs";
+
+	if (ss.tellp() == 0 && memcmp(native.getPPU().getFramebuffer(),
+	                              reference.getPPU().getFramebuffer(),
+	                              SCREEN_WIDTH * SCREEN_HEIGHT * sizeof(u32)) != 0)
+		ss << "framebuffers differ";
+
+	return ss.str();
+}
+
+int main(int argc, char *argv[])
+{
+#ifdef GBMU_RECOMPILER
+	if (argc != 3 && argc != 4) {
+		std::cerr << "Usage: " << argv[0] << " <rom> <frames> [<blocks.so>]" << std::endl;
+		return 1;
+	}
+#else
+	if (argc != 3) {
+		std::cerr << "Usage: " << argv[0] << " <rom> <frames>" << std::endl;
+		return 1;
+	}
+#endif
+
+	// Nothing to show or play
+	setenv("SDL_VIDEODRIVER", "dummy", 0);
+	setenv("SDL_AUDIODRIVER", "dummy", 0);
+
+	auto native    = std::make_unique<GameBoy>(argv[1]);
+	auto reference = std::make_unique<GameBoy>(argv[1]);
+	u64  cycles    = std::stoull(argv[2]) * CYCLES_PER_FRAME;
+	u64  checks    = 0;
+	u64  synced    = 0; // Last cycle both reached
+
+#ifdef GBMU_RECOMPILER
+	if (argc == 4)
+		native->getCPU().loadNativeBlocks(argv[3]);
+#endif
+#ifdef GBMU_DYNAREC
+	reference->getCPU().setDynarecEnabled(false);
+#endif
+
+	while (native->elapsedCycles() < cycles) {
+		u16 pc   = native->getHotState().registers.pc;
+		u16 bank = native->getCartridge().getRomBank();
+		u64 from = native->elapsedCycles();
+
+		native->step();
+		while (reference->elapsedCycles() < native->elapsedCycles())
+			reference->step();
+
+		// The interpreter went past the end of the native step, they meet again later
+		if (reference->elapsedCycles() != native->elapsedCycles()) {
+			if (native->elapsedCycles() - synced < CYCLES_PER_FRAME)
+				continue;
+
+			std::cerr << "No common cycle since " << synced << " after the step from 0x"
+			          << std::hex << std::setw(4) << std::setfill('0') << pc << " in bank "
+			          << std::dec << bank << std::endl;
+			return 1;
+		}
+
+		synced = native->elapsedCycles();
+		checks++;
+
+		std::string difference = compare(*native, *reference);
+		if (!difference.empty()) {
+			std::cerr << "After the step from 0x" << std::hex << std::setw(4) << std::setfill('0')
+			          << pc << " in bank " << std::dec << bank << " at cycle " << from << ": "
+			          << difference << std::endl;
+			return 1;
+		}
+	}
+
+	std::cerr << "Native and interpreted runs matched at " << checks << " steps over " << argv[2]
+	          << " frames" << std::endl;
+
+	return 0;
+}
@@ -1,8 +1,27 @@
 #include <GBMU/GameBoy.hpp>
+#include <GBMU/RomPatch.hpp>
+#include <cstdlib>
 
+// emulator <rom> [<patch.ips|patch.bps>] [<blocks.so>], the extra files in any order. The
+// GBMU_SAVE_INTERVAL_MS environment variable overrides the interval between saves
 int main(int argc, char *argv[])
 {
-	GBMU::GameBoy gb(argv[1]);
+	if (const char *interval = getenv("GBMU_SAVE_INTERVAL_MS"))
+		GBMU::Cartridge::setSaveInterval(std::chrono::milliseconds(atol(interval)));
+
+	std::string patch;
+	for (int i = 2; i < argc; i++) {
+		if (GBMU::RomPatch::isPatchFile(argv[i]))
+			patch = argv[i];
+	}
+
+	GBMU::GameBoy gb(argv[1], patch);
+#ifdef GBMU_RECOMPILER
+	for (int i = 2; i < argc; i++) {
+		if (!GBMU::RomPatch::isPatchFile(argv[i]))
+			gb.getCPU().loadNativeBlocks(argv[i]);
+	}
+#endif
 	gb.run();
 
 	return 0;
@@ -0,0 +1,173 @@
+#include <GBMU/BlockCache.hpp>
+#include <GBMU/CartridgeHeader.hpp>
+#include <GBMU/Opcodes.hpp>
+#include <GBMU/RomImage.hpp>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <set>
+#include <utility>
+#include <vector>
+
+// Ahead-of-time recompiler: walks the code reachable from the entry points of a ROM, and emits
+// C++ running each block with the interpreter's own opcode handlers, operands included. Once
+// built into a shared object, `emulator <rom> <object>` runs those blocks in one step each.
+//
+//   recompiler game.gb game.cpp
+//   c++ -std=c++20 -O2 -shared -fPIC -DGBMU_RECOMPILER -I include game.cpp -o game.so
+//
+// `lockstep game.gb 600 game.so` checks the object against the interpreter. It must be built
+// with the same GBMU_* definitions as the emulator. Indirect jumps (jp hl, ret, reti) are not
+// followed: the code they lead to, like code running from RAM, goes through the interpreter.
+
+using namespace GBMU;
+
+using Location = std::pair<u16, u16>; // (bank, address)
+
+// Bank mapped at address when jumping there from code in from_bank, or -1 if it can't be told
+static int target_bank(const BlockCache &cache, u16 from_bank, int switched, u16 address)
+{
+	if (address <= 0x3fff)
+		return 0;
+	if (address > 0x7fff)
+		return -1;
+	if (switched >= 0)
+		return switched;
+	if (from_bank != 0)
+		return from_bank;
+	return cache.bankCount() == 2 ? 1 : -1;
+}
+
+// Bank selected by a `ld a, imm8; ld [0x2000-0x3fff], a` sequence in the block, if any
+static int switched_bank(const BlockCache &cache, const std::vector<u8> &code)
+{
+	int a    = -1;
+	int bank = -1;
+
+	for (size_t i = 0; i < code.size(); i += INSTRUCTION_LENGTHS[code[i]]) {
+		u8 opcode = code[i];
+
+		if (opcode == 0x3E)
+			a = code[i + 1];
+		else if (opcode == 0xEA) {
+			u16 address = code[i + 1] | (code[i + 2] << 8);
+			if (address >= 0x2000 && address <= 0x3fff && a >= 0) {
+				size_t selected = a == 0 ? 1 : a;
+				bank            = selected < cache.bankCount() ? selected : -1;
+			}
+		} else if (opcode != 0x00 && opcode != 0x02 && opcode != 0x12 && opcode != 0x22 &&
+		           opcode != 0x32 && opcode != 0x77 && opcode != 0xE0 && opcode != 0xE2)
+			a = -1; // Anything else may change a
+	}
+
+	return bank;
+}
+
+int main(int argc, char *argv[])
+{
+	if (argc != 3) {
+		std::cerr << "Usage: " << argv[0] << " <rom> <output.cpp>" << std::endl;
+		return 1;
+	}
+
+	// Only the ROM is needed, not a running Game Boy
+	std::shared_ptr<const RomImage>              rom = RomImage::load(argv[1]);
+	BlockCache                                   cache(*rom);
+
+	std::map<Location, std::vector<u8>>          blocks; // Code of every reachable block
+	std::vector<Location>                        pending;
+
+	// Entry point, rst vectors and interrupt handlers
+	pending.emplace_back(0, 0x100);
+	for (u16 vector = 0x00; vector <= 0x60; vector += 8)
+		pending.emplace_back(0, vector);
+
+	while (!pending.empty()) {
+		auto [bank, address] = pending.back();
+		pending.pop_back();
+
+		if (blocks.count({bank, address}))
+			continue;
+
+		const BlockCache::Block *block = cache.lookup(bank, address);
+		if (!block)
+			continue;
+
+		std::vector<u8> &code = blocks[{bank, address}];
+		for (const BlockCache::Instruction &instruction : block->instructions)
+			code.insert(code.end(), instruction.bytes, instruction.bytes + instruction.length);
+
+		// Successors of the last instruction
+		const BlockCache::Instruction &last     = block->instructions.back();
+		u8                             opcode   = last.bytes[0];
+		int                            switched = switched_bank(cache, code);
+		std::vector<u16>               targets;
+
+		if (opcode == 0x18 || (opcode & 0xE7) == 0x20)
+			targets.push_back(block->end + static_cast<s8>(last.bytes[1]));
+		else if (opcode == 0xC3 || (opcode & 0xE7) == 0xC2 || opcode == 0xCD ||
+		         (opcode & 0xE7) == 0xC4)
+			targets.push_back(last.bytes[1] | (last.bytes[2] << 8));
+		else if ((opcode & 0xC7) == 0xC7)
+			targets.push_back(opcode & 0x38);
+
+		// Unconditional jumps and returns are the only ones that never go on to the next byte
+		if (opcode != 0x18 && opcode != 0xC3 && opcode != 0xC9 && opcode != 0xD9 && opcode != 0xE9)
+			targets.push_back(block->end);
+
+		for (u16 target : targets) {
+			int target_in = target_bank(cache, bank, switched, target);
+			if (target_in >= 0)
+				pending.emplace_back(target_in, target);
+		}
+	}
+
+	if (blocks.empty()) {
+		std::cerr << "No code reachable in " << argv[1] << std::endl;
+		return 1;
+	}
+
+	std::ofstream out(argv[2]);
+	out << std::hex << std::setfill('0');
+
+	out << "// Generated by recompiler from " << argv[1] << ", do not edit\n\n"
+	    << "#include <GBMU/CPUInstructions.hpp>\n\n"
+	    << "using namespace GBMU;\n";
+
+	for (const auto &[location, code] : blocks) {
+		out << "\nstatic void block_" << std::setw(4) << location.first << "_" << std::setw(4)
+		    << location.second << "(CPU &cpu)\n{\n\tstatic const u8 bytes[] = {";
+		for (size_t i = 0; i < code.size(); i++)
+			out << (i ? ", " : "") << "0x" << std::setw(2) << (int)code[i];
+
+		out << "};\n\tCPU::run_block<";
+		for (size_t i = 0; i < code.size(); i += INSTRUCTION_LENGTHS[code[i]]) {
+			out << (i ? ", " : "") << "0x";
+			if (code[i] == 0xCB)
+				out << "CB" << std::setw(2) << (int)code[i + 1];
+			else
+				out << std::setw(2) << (int)code[i];
+		}
+		out << ">(cpu, bytes);\n}\n";
+	}
+
+	out << "\nextern \"C\" const BlockCache::Native gbmu_native_blocks[] = {\n";
+	for (const auto &[location, code] : blocks)
+		out << "    {0x" << std::setw(4) << location.first << ", 0x" << std::setw(4)
+		    << location.second << ", block_" << std::setw(4) << location.first << "_"
+		    << std::setw(4) << location.second << "},\n";
+	out << "};\n\n";
+
+	out << std::dec << "extern \"C\" const size_t gbmu_native_block_count = " << blocks.size()
+	    << ";\n"
+	    << "extern \"C\" const u16    gbmu_native_global_checksum = "
+	    << CartridgeHeader(rom->getData(), rom->getSize()).getGlobalChecksum() << ";\n"
+	    << "extern \"C\" const size_t gbmu_native_rom_size = " << rom->getSize() << ";\n"
+	    << "extern \"C\" const size_t gbmu_native_cpu_size = sizeof(CPU);\n";
+
+	std::cerr << blocks.size() << " blocks written to " << argv[2] << std::endl;
+
+	return 0;
+}